@@ -46,10 +46,24 @@
 #include <libevdev-1.0/libevdev/libevdev.h>
 
 
+#include <algorithm>
 #include <fcntl.h>
 #include <iostream>
+#include <limits.h>
+#include <math.h>
+#include <new>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <sstream>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 
@@ -59,6 +73,240 @@
 #define SDL_DEFAULT_REPEAT_DELAY 500
 #define SDL_DEFAULT_REPEAT_INTERVAL 30
 
+#define MODIFIER_CTRL 1 // *_modifier values are a combination of these flags
+#define MODIFIER_ALT 2
+#define MODIFIER_SHIFT 4
+
+#define MACRO_MAX 16 // macros are named macro1 .. macro16
+#define MACRO_STEPS_MAX 256 // compiled steps across all macros
+#define MACRO_RUNNING_MAX 8 // macros that can run at the same time
+#define MACRO_TAP_DELAY 16 // ms between press and release of a tapped key
+
+#define MACRO_PRESS 0
+#define MACRO_RELEASE 1
+#define MACRO_DELAY 2
+
+#define LAYER_MAX 8 // layers are named layer1 .. layer8
+#define LAYER_HOTKEY (LAYER_MAX + 1) // built-in layer with the _hk keys, activated by the hotkey button
+#define LAYER_COUNT (LAYER_MAX + 2)
+#define LAYER_CHORD_BITS 8 // distinct buttons that can be used in layer chords
+#define LAYER_L2 SDL_CONTROLLER_BUTTON_MAX // layers map the triggers too, after the buttons
+#define LAYER_R2 (SDL_CONTROLLER_BUTTON_MAX + 1)
+#define LAYER_KEYS (SDL_CONTROLLER_BUTTON_MAX + 2)
+
+#define TOUCHPAD_FINGER_MAX 4 // fingers tracked on the first touchpad
+#define TOUCHPAD_REGION_MAX 8 // regions are named touchpad_region1 .. touchpad_region8
+
+#define FF_EFFECTS_MAX 16 // rumble effects a game can upload to the fake Xbox 360 pad
+
+#define MOUSE_WHEEL_UP (KEY_CNT + 0) // pseudo key codes that scroll, above every real key code
+#define MOUSE_WHEEL_DOWN (KEY_CNT + 1)
+#define MOUSE_WHEEL_LEFT (KEY_CNT + 2)
+#define MOUSE_WHEEL_RIGHT (KEY_CNT + 3)
+#define MOUSE_WHEEL_NOTCH 120 // REL_WHEEL_HI_RES units in one notch of a normal wheel
+
+#define MOUSE_RELATIVE 0 // REL_X/REL_Y on the fake keyboard
+#define MOUSE_ABSOLUTE_VELOCITY 1 // stick speed moves an absolute pointer
+#define MOUSE_ABSOLUTE_POSITION 2 // stick position is the pointer position within a screen region
+
+#define MOUSE_TICK_STRETCH_MAX 4 // with power_save, slow mouse ticks are up to this many times further apart
+#define MOUSE_TICK_MIN_STEP 4 // pixels a stretched tick moves at least
+#define MOUSE_TICK_MIN_WHEEL_STEP 30.0f // hi-res wheel units a stretched tick scrolls at least
+
+#define ANALOG_DIR_UP 1
+#define ANALOG_DIR_DOWN 2
+#define ANALOG_DIR_LEFT 4
+#define ANALOG_DIR_RIGHT 8
+
+#define ANALOG_MODE_AXIS 0 // each axis maps to its keys independently
+#define ANALOG_MODE_4WAY 1 // one of four 90 degree sectors
+#define ANALOG_MODE_8WAY 2 // four cardinal sectors plus four diagonal sectors
+#define ANALOG_SLOPE_ONE 1024 // fixed point scale of sector boundary slopes (dy/dx)
+
+// Opt-in scheduling for the input (main) thread, and the evidence that it
+// pays off: timer wakeup lateness, and C++ heap allocations made by the
+// input thread once the loop runs. Only operator new is seen; malloc calls
+// (SDL, libc) are not counted
+struct
+{
+  int rt_priority = 0; // SCHED_FIFO priority, 0 to keep the normal scheduler
+  int cpu = -1; // CPU to pin the input thread to, -1 for any
+  bool mlock = false;
+  unsigned long allocations = 0; // operator new calls on the input thread in the main loop
+  unsigned long latency_samples = 0;
+  Uint64 latency_total_us = 0;
+  Uint64 latency_max_us = 0;
+} realtime;
+
+thread_local bool counting_allocations = false; // set on the input thread while the main loop runs
+
+void* operator new(size_t size)
+{
+  if (counting_allocations) {
+    realtime.allocations++; // only ever the input thread
+  }
+  void* p = malloc(size ? size : 1);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_RECORDS 128 // must be a power of two
+#define LOG_RECORD_BYTES 192
+
+// Messages from the event path are formatted into a lock-free ring and
+// written out by a background thread, so a slow stdout (e.g. a log file on
+// an SD card) never holds up input. Producers claim slots with a CAS on head;
+// each slot's seq tells whose turn it is (a bounded MPMC queue), and a full
+// ring drops the message instead of waiting
+struct log_record
+{
+  Uint32 seq;
+  char text[LOG_RECORD_BYTES];
+};
+
+struct
+{
+  int level = LOG_INFO;
+  log_record records[LOG_RECORDS];
+  Uint32 head = 0; // next slot to fill
+  Uint32 tail = 0; // next slot to write out, only used by the writer
+  Uint32 dropped = 0;
+  SDL_sem* wake = NULL; // NULL while no writer thread runs; messages are then printed directly
+  SDL_Thread* thread = NULL;
+  bool stopping = false;
+  bool draining = false; // held while a thread other than the writer drains, at shutdown
+} logger;
+
+void drainLog();
+
+// After shutdown has started, whoever publishes or stops writes out the ring
+// themselves, one at a time, so no message is left in a slot nobody reads
+void drainLogAtShutdown()
+{
+  while (__atomic_exchange_n(&logger.draining, true, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+  drainLog();
+  __atomic_store_n(&logger.draining, false, __ATOMIC_RELEASE);
+}
+
+void logMessage(int level, const char* format, ...)
+{
+  if (level > logger.level) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  // the semaphore is never destroyed, so a helper thread racing shutdown can still post it
+  SDL_sem* wake = __atomic_load_n(&logger.wake, __ATOMIC_ACQUIRE);
+  if (wake == NULL) {
+    vprintf(format, args);
+    va_end(args);
+    return;
+  }
+
+  Uint32 pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+  log_record* r;
+  while (true) {
+    r = &logger.records[pos & (LOG_RECORDS - 1)];
+    const int diff = (int)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&logger.head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (diff < 0) {
+      __atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED);
+      va_end(args);
+      return;
+    } else {
+      pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+    }
+  }
+  vsnprintf(r->text, LOG_RECORD_BYTES, format, args);
+  va_end(args);
+  __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+  SDL_SemPost(wake);
+  if (__atomic_load_n(&logger.wake, __ATOMIC_ACQUIRE) == NULL) {
+    drainLogAtShutdown(); // the writer may already have made its last pass
+  }
+}
+
+void drainLog()
+{
+  while (true) {
+    log_record& r = logger.records[logger.tail & (LOG_RECORDS - 1)];
+    if (__atomic_load_n(&r.seq, __ATOMIC_ACQUIRE) != logger.tail + 1) break;
+    fputs(r.text, stdout);
+    __atomic_store_n(&r.seq, logger.tail + LOG_RECORDS, __ATOMIC_RELEASE);
+    logger.tail++;
+  }
+  if (const Uint32 dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED)) {
+    printf("%u log messages dropped\n", dropped);
+  }
+  fflush(stdout);
+}
+
+int loggerThread(void*)
+{
+  while (!__atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE)) {
+    SDL_SemWait(logger.wake);
+    drainLog();
+  }
+  drainLog();
+  return 0;
+}
+
+void startLogger()
+{
+  for (Uint32 i = 0; i < LOG_RECORDS; i++) {
+    logger.records[i].seq = i;
+  }
+  fflush(stdout);
+  SDL_sem* wake = SDL_CreateSemaphore(0);
+  if (wake == NULL) {
+    return;
+  }
+  logger.wake = wake; // the writer thread waits on it
+  if ((logger.thread = SDL_CreateThread(loggerThread, "log", NULL)) == NULL) {
+    logger.wake = NULL;
+    SDL_DestroySemaphore(wake);
+  }
+}
+
+// Write out anything still queued; later messages are printed directly.
+// The helper threads are detached and may still be logging, so the
+// semaphore is left alive and the ring is drained once more from here
+void stopLogger()
+{
+  if (logger.thread == NULL) {
+    return;
+  }
+  __atomic_store_n(&logger.stopping, true, __ATOMIC_RELEASE);
+  SDL_SemPost(logger.wake);
+  SDL_WaitThread(logger.thread, NULL);
+  logger.thread = NULL;
+  __atomic_store_n(&logger.wake, (SDL_sem*)NULL, __ATOMIC_RELEASE);
+  drainLogAtShutdown();
+}
+
+int logLevelFromString(const char* str)
+{
+  if (strcmp(str, "error") == 0) return LOG_ERROR;
+  if (strcmp(str, "warn") == 0) return LOG_WARN;
+  if (strcmp(str, "info") == 0) return LOG_INFO;
+  if (strcmp(str, "debug") == 0) return LOG_DEBUG;
+  return atoi(str);
+}
+
 struct config_option
 {
   char key[CONFIG_ARG_MAX_BYTES];
@@ -105,6 +353,51 @@ std::vector<config_option> parseConfigFile(const char* path)
 static int uinp_fd = -1;
 struct uinput_user_dev uidev;
 
+#define OUTPUT_QUEUE_MAX 64
+
+// Output events are queued here and written to uinput once per processed SDL
+// event batch; only the main loop touches this
+struct
+{
+  struct input_event events[OUTPUT_QUEUE_MAX];
+  int count = 0;
+  int abs_value[ABS_CNT];
+  bool abs_is_pending[ABS_CNT];
+  int abs_pending[ABS_CNT]; // axes changed in the current frame, in arrival order
+  int abs_pending_count = 0;
+  int rel_x = 0;
+  int rel_y = 0;
+  int wheel = 0; // REL_WHEEL_HI_RES units, MOUSE_WHEEL_NOTCH per notch
+  int wheel_notch = 0; // hi-res units not yet reported as a whole REL_WHEEL notch
+  int hwheel = 0; // REL_HWHEEL_HI_RES units
+  int hwheel_notch = 0;
+} output;
+
+// Optional second uinput device, a touchscreen whose position is the mouse
+// pointer and whose touch follows BTN_LEFT; batched like the main output
+struct
+{
+  int fd = -1;
+  uinput_user_dev device;
+  int x = 0; // pixels, clamped to the configured screen size
+  int y = 0;
+  bool moved = false; // position changed since the last report
+  bool touch = false;
+  bool touch_changed = false;
+} pointer;
+
+#define KEY_STATE_BITS (8 * sizeof(unsigned long))
+
+// What the virtual device currently reports as held, plus how many mappings
+// hold each key, so a key shared by several buttons (e.g. two buttons with
+// add_shift) is only released once the last of them is released
+struct
+{
+  unsigned long pressed[KEY_CNT / KEY_STATE_BITS];
+  unsigned char refcount[KEY_CNT];
+} key_state;
+
+
 int kill_signal = 15;
 bool kill_mode = false;
 bool sudo_kill = false; //allow sudo kill instead of killall for non-emuelec systems
@@ -115,20 +408,32 @@ bool textinputpreset_mode = false;
 bool textinputinteractive_mode = false;
 bool textinputinteractive_noautocapitals = false;
 bool textinputinteractive_extrasymbols = false;
+bool textinputinteractive_daisywheel = false;
 bool app_exult_adjust = false;
 
 const int maxKeysNoExtendedSymbols = 69; //number of keys available for interactive text input
 const int maxKeysWithSymbols = 96; //number of keys available for interactive text input with extra symbols
 int maxKeys = maxKeysNoExtendedSymbols;
 const int maxChars = 20; // length of text in characters that can be entered
-int character_set[maxKeysWithSymbols]; // keys that can be selected in text input interactive mode
-bool character_set_shift[maxKeysWithSymbols]; // indicate which keys require shift
+#define TEXT_SHIFT 1
+#define TEXT_ALTGR 2
+
+// How to type one character on the selected keyboard layout
+struct text_key
+{
+  short code; // 0 if the layout can't type it
+  Uint8 modifiers; // TEXT_SHIFT and TEXT_ALTGR held for the key
+  Uint8 dead; // dead key typed first (TEXT_DEAD_*), 0 for none
+};
+
+text_key character_set[maxKeysWithSymbols]; // keys that can be selected in text input interactive mode
 int current_character = 0; 
 int current_key[maxChars]; // current key selected for each key
 char* AppToKill;
 bool config_mode = false;
 bool hotkey_override = false;
 char* hotkey_code;
+int hotkey_button = SDL_CONTROLLER_BUTTON_INVALID; // chord of the hotkey layer, from hotkey_code
 
 struct
 {
@@ -139,14 +444,19 @@ struct
   int textinputconfirmtrigger_jsdevice; // to trigger text input confirm via Enter key
   int mouseX = 0;
   int mouseY = 0;
+  float wheel_x_speed = 0.0f; // hi-res wheel units per mouse tick from a stick used as a wheel
+  float wheel_y_speed = 0.0f;
+  float wheel_remainder_x = 0.0f; // fractions of a hi-res unit carried over to the next tick
+  float wheel_remainder_y = 0.0f;
   int current_left_analog_x = 0;
   int current_left_analog_y = 0;
   int current_right_analog_x = 0;
   int current_right_analog_y = 0;
   int current_l2 = 0;
   int current_r2 = 0;
-  bool hotkey_pressed = false; // current state of hotkey
-  bool hotkey_was_pressed = false; // indicates hotkey button has been pressed, and key may need to be processed on button's release, if hotkey combo isn't triggered
+  int previous_axis_value[SDL_CONTROLLER_AXIS_MAX] = {}; // raw values, before deadzone and hysteresis
+  unsigned long analog_transitions_suppressed = 0; // press/release edges absorbed by hysteresis
+  bool hotkey_pressed = false; // current state of hotkey, for kill mode
   bool start_pressed = false;
   bool start_was_pressed = false; // indicates start button has been pressed, and key may need to be processed on button's release, if start combo isn't triggered
   bool textinputinteractive_mode_active = false;
@@ -161,22 +471,21 @@ struct
   bool right_analog_was_down = false;
   bool right_analog_was_left = false;
   bool right_analog_was_right = false;
-  bool a_hk_was_pressed = false;
-  bool b_hk_was_pressed = false;
-  bool x_hk_was_pressed = false;
-  bool y_hk_was_pressed = false;
-  bool l1_hk_was_pressed = false;
-  bool r1_hk_was_pressed = false;
   bool l2_was_pressed = false;
-  bool l2_hk_was_pressed = false;
   bool r2_was_pressed = false;
-  bool r2_hk_was_pressed = false;
-  bool hotkey_combo_triggered = false; //keep track of whether a hotkey combo was pressed; if so, don't send hotkey key when hotkey is released
   bool start_combo_triggered = false; //keep track of whether a start combo was pressed; if so, don't send start key when start is released
   short key_to_repeat = 0;
-  SDL_TimerID key_repeat_timer_id = 0;
+  Uint64 key_repeat_at = 0; // monotonic time of the next repeat
+  bool key_repeat_text_input = false; // repeat steps the interactive text input selection instead of a key
 } state;
 
+// Where one direction of a stick, or a trigger, engages and releases as a key
+struct analog_threshold
+{
+  int engage;
+  int release;
+};
+
 struct
 {
   short back = KEY_ESC;
@@ -189,48 +498,32 @@ struct
   bool guide_repeat = false;
   short guide_modifier = 0;
   short a = KEY_X;
-  short a_hk = KEY_ENTER;
   bool a_repeat = false;
   short a_modifier = 0;
-  short a_hk_modifier = 0;
   short b = KEY_Z;
-  short b_hk = KEY_ESC;
   bool b_repeat = false;
   short b_modifier = 0;
-  short b_hk_modifier = 0;
   short x = KEY_C;
-  short x_hk = KEY_C;
   bool x_repeat = false;
   short x_modifier = 0;
-  short x_hk_modifier = 0;
   short y = KEY_A;
-  short y_hk = KEY_A;
   bool y_repeat = false;
   short y_modifier = 0;
-  short y_hk_modifier = 0;
   short l1 = KEY_RIGHTSHIFT;
-  short l1_hk = KEY_ESC;
   bool l1_repeat = false;
   short l1_modifier = 0;
-  short l1_hk_modifier = 0;
   short l2 = KEY_HOME;
-  short l2_hk = KEY_HOME;
   bool l2_repeat = false;
   short l2_modifier = 0;
-  short l2_hk_modifier = 0;
   short l3 = BTN_LEFT;
   bool l3_repeat = false;
   short l3_modifier = 0;
   short r1 = KEY_LEFTSHIFT;
-  short r1_hk = KEY_ENTER;
   bool r1_repeat = false;
   short r1_modifier = 0;
-  short r1_hk_modifier = 0;
   short r2 = KEY_END;
-  short r2_hk = KEY_END;
   bool r2_repeat = false;
   short r2_modifier = 0;
-  short r2_hk_modifier = 0;
   short r3 = BTN_RIGHT;
   bool r3_repeat = false;
   short r3_modifier = 0;
@@ -249,6 +542,8 @@ struct
 
   bool left_analog_as_mouse = false;
   bool right_analog_as_mouse = false;
+  bool left_analog_as_wheel = false;
+  bool right_analog_as_wheel = false;
   short left_analog_up = KEY_W;
   bool left_analog_up_repeat = false;
   short left_analog_up_modifier = 0;
@@ -274,23 +569,151 @@ struct
   bool right_analog_right_repeat = false;
   short right_analog_right_modifier = 0;
 
+  int left_analog_mode = ANALOG_MODE_AXIS;
+  int right_analog_mode = ANALOG_MODE_AXIS;
+  int analog_diagonal_width = 45; // degrees covered by each diagonal sector in 8-way mode
+  int analog_diagonal_slope_low = 424; // tan(22.5) * ANALOG_SLOPE_ONE
+  int analog_diagonal_slope_high = 2472; // tan(67.5) * ANALOG_SLOPE_ONE
+
   int deadzone_y = 15000;
   int deadzone_x = 15000;
   int deadzone_triggers = 3000;
+  int deadzone_y_release = -1; // -1 selects 3/4 of each direction's deadzone
+  int deadzone_x_release = -1;
+  int deadzone_triggers_release = -1;
+  // per direction and per trigger, -1 follows deadzone_y, deadzone_x or deadzone_triggers
+  analog_threshold deadzone_up = {-1, -1};
+  analog_threshold deadzone_down = {-1, -1};
+  analog_threshold deadzone_left = {-1, -1};
+  analog_threshold deadzone_right = {-1, -1};
+  analog_threshold deadzone_l2 = {-1, -1};
+  analog_threshold deadzone_r2 = {-1, -1};
 
   int fake_mouse_scale = 512;
   int fake_mouse_delay = 16;
+  bool power_save = true; // sleep on the controller devices, and stretch slow mouse ticks
+  int mouse_wheel_scale = 2048; // stick deflection per hi-res wheel unit each mouse tick; larger scrolls slower
 
   Uint32 key_repeat_interval = SDL_DEFAULT_REPEAT_INTERVAL * 2; 
   Uint32 key_repeat_delay = SDL_DEFAULT_REPEAT_DELAY; 
   
   char* text_input_preset;
+  int keyboard_layout = 0; // index into keyboard_layouts, used for text input
+  int type_rate = 40; // characters per second typed from --type-file
+  int type_burst = 1; // characters typed together on each tick of --type-file
+
+  int button_macro[SDL_CONTROLLER_BUTTON_MAX] = {}; // macro number run by each button, 0 for none
+  short button_hold[SDL_CONTROLLER_BUTTON_MAX] = {}; // key sent when a dual-role button is held, 0 for none
+  short button_hold_modifier[SDL_CONTROLLER_BUTTON_MAX] = {};
+  Uint32 hold_delay = 200; // ms a dual-role button must be held before it counts as held
+  int button_turbo[SDL_CONTROLLER_BUTTON_MAX] = {}; // turbo rate in presses per second, 0 for none
+  int button_turbo_duty[SDL_CONTROLLER_BUTTON_MAX] = {}; // % of each turbo cycle the key is down, 0 for turbo_duty
+  int turbo_duty = 50;
+
+  Uint32 layer_chord[LAYER_COUNT] = {}; // SDL button mask that activates each layer, 0 if unused
+  short layer_key[LAYER_COUNT][LAYER_KEYS] = {}; // key per button and trigger in each layer, 0 for none
+  short layer_modifier[LAYER_COUNT][LAYER_KEYS] = {};
+
+  bool gyro_mouse = false;
+  int gyro_button = SDL_CONTROLLER_BUTTON_INVALID; // gyro only moves the mouse while this is held, if set
+  float gyro_sensitivity = 10.0f; // pixels per degree turned, when turning slowly
+  float gyro_sensitivity_max = -1.0f; // pixels per degree at gyro_accel_speed and above, -1 for gyro_sensitivity
+  float gyro_accel_speed = 180.0f; // degrees per second
+  float gyro_smoothing = 5.0f; // degrees per second below which motion is smoothed, 0 to disable
+  int gyro_calibration = 1000; // ms spent measuring drift when the controller is connected
+
+  bool touchpad_mouse = false;
+  float touchpad_sensitivity = 1000.0f; // pixels for a swipe across the whole touchpad width
+  float touchpad_scroll_sensitivity = 1200.0f; // REL_WHEEL_HI_RES units for a two finger swipe down the touchpad
+  bool touchpad_tap = true;
+  int touchpad_region[TOUCHPAD_REGION_MAX + 1][4] = {}; // left, top, right, bottom in % of the touchpad, all 0 if unused
+  short touchpad_region_key[TOUCHPAD_REGION_MAX + 1] = {};
+  short touchpad_region_modifier[TOUCHPAD_REGION_MAX + 1] = {};
+
+  int mouse_absolute = MOUSE_RELATIVE;
+  int mouse_absolute_width = 1280; // screen size in pixels, also the touchscreen's range
+  int mouse_absolute_height = 720;
+  int mouse_absolute_region[4] = {0, 0, 100, 100}; // area the stick covers in position mode, in % of the screen
 } config;
 
+struct macro_step
+{
+  unsigned char action; // MACRO_PRESS, MACRO_RELEASE or MACRO_DELAY
+  unsigned short value; // key code, or delay in ms
+};
+
+// Macros are compiled at config load into one flat step array
+struct
+{
+  macro_step steps[MACRO_STEPS_MAX];
+  int step_count = 0;
+  int start[MACRO_MAX + 1] = {}; // first step of each macro, indexed by macro number
+  int length[MACRO_MAX + 1] = {};
+} macros;
+
+// A macro in progress; resumed from the main loop once resume_at has passed
+struct macro_run
+{
+  int macro = 0; // 0 when the slot is free
+  int step = 0;
+  Uint64 resume_at = 0; // monotonic time in microseconds
+};
+
+macro_run running_macros[MACRO_RUNNING_MAX];
+
+// Compact lookup built at config load: the held layer buttons are kept as a
+// small bitmask, which indexes straight into the active layer, so resolving a
+// layer is O(1) however many layers and chords are defined
+struct
+{
+  unsigned int chord_bit[SDL_CONTROLLER_BUTTON_MAX] = {}; // bit in the compact mask, 0 if the button is in no chord
+  unsigned char active_layer[1 << LAYER_CHORD_BITS] = {}; // compact held mask -> layer number, 0 for none
+  unsigned int held = 0; // compact mask of currently held chord buttons
+  bool layer_used = false; // a layer key was sent while chord buttons were held
+  short pressed_key[LAYER_KEYS] = {}; // key sent through a layer, released with the button
+  short pressed_modifier[LAYER_KEYS] = {};
+} layers;
+
+#define DUAL_ROLE_IDLE 0
+#define DUAL_ROLE_PENDING 1 // pressed, waiting to see if it is released before hold_delay
+#define DUAL_ROLE_HOLD 2 // hold key is down until the button is released
+#define DUAL_ROLE_TAP 3 // tap key is down until its release is due
+
+struct dual_role
+{
+  int state = DUAL_ROLE_IDLE;
+  Uint64 deadline = 0; // when a pending press becomes a hold, or a tap is released
+};
+
+dual_role dual_roles[SDL_CONTROLLER_BUTTON_MAX];
+
+struct touchpad_finger
+{
+  bool down = false;
+  int region = 0; // region whose key this finger holds, 0 if it drives the pointer
+  float x = 0.0f; // last position, 0..1 across the touchpad
+  float y = 0.0f;
+  float travel = 0.0f; // distance moved since touching down
+};
+
+struct
+{
+  touchpad_finger fingers[TOUCHPAD_FINGER_MAX];
+  int pointer_fingers = 0; // fingers down outside any region
+  int gesture_fingers = 0; // most pointer fingers down at once since the first touched down
+  Uint32 gesture_start = 0; // SDL ticks when the first pointer finger touched down
+  bool gesture_moved = false; // too much travel for the gesture to be a tap
+  float remainder_x = 0.0f; // sub-pixel motion carried over to the next event
+  float remainder_y = 0.0f;
+  float scroll_remainder = 0.0f;
+  int click_button = 0; // mouse button pressed by a tap, 0 if none
+  Uint64 click_release_at = 0;
+} touchpad;
+
 // convert ASCII chars to key codes
 short char_to_keycode(const char* str)
 {
-  short keycode;
+  short keycode = 0; // unknown names give 0
 
   // arrow keys
   if (strcmp(str, "up") == 0)
@@ -307,6 +730,20 @@ short char_to_keycode(const char* str)
     keycode = BTN_LEFT;
   else if (strcmp(str, "mouse_right") == 0)
     keycode = BTN_RIGHT;
+  else if (strcmp(str, "mouse_middle") == 0)
+    keycode = BTN_MIDDLE;
+  else if (strcmp(str, "mouse_side") == 0)
+    keycode = BTN_SIDE;
+  else if (strcmp(str, "mouse_extra") == 0)
+    keycode = BTN_EXTRA;
+  else if (strcmp(str, "mouse_wheel_up") == 0)
+    keycode = MOUSE_WHEEL_UP;
+  else if (strcmp(str, "mouse_wheel_down") == 0)
+    keycode = MOUSE_WHEEL_DOWN;
+  else if (strcmp(str, "mouse_wheel_left") == 0)
+    keycode = MOUSE_WHEEL_LEFT;
+  else if (strcmp(str, "mouse_wheel_right") == 0)
+    keycode = MOUSE_WHEEL_RIGHT;
   else if (strcmp(str, "space") == 0)
     keycode = KEY_SPACE;
   else if (strcmp(str, "esc") == 0)
@@ -535,220 +972,628 @@ void initialiseCharacters()
 
 }
 
-void initialiseCharacterSet()
+#define TEXT_DEAD_GRAVE 1
+#define TEXT_DEAD_ACUTE 2
+#define TEXT_DEAD_CIRCUMFLEX 3
+#define TEXT_DEAD_TILDE 4
+#define TEXT_DEAD_DIAERESIS 5
+#define TEXT_DEAD_KINDS 6
+#define TEXT_LAYOUT_EURO (0x100 - 0x20) // slot for U+20AC, after printable Latin-1
+#define TEXT_LAYOUT_SLOTS (TEXT_LAYOUT_EURO + 1)
+#define TEXT_LAYOUT_KEYS 48
+
+// The keys whose characters change between layouts, in the order keyboard_layout lists them
+constexpr short layout_keycodes[TEXT_LAYOUT_KEYS] = {
+  KEY_GRAVE, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL,
+  KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_LEFTBRACE, KEY_RIGHTBRACE,
+  KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L, KEY_SEMICOLON, KEY_APOSTROPHE, KEY_BACKSLASH,
+  KEY_102ND, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M, KEY_COMMA, KEY_DOT, KEY_SLASH,
+};
+
+// UTF-8 characters typed by each key of layout_keycodes, without modifiers, with
+// shift and with AltGr; ' ' where a key types nothing useful and the rest of a
+// string may be left out. Combining accents (U+0300 and so on) mark dead keys.
+// These follow the X11 layouts of the same name
+struct keyboard_layout
+{
+  const char* name;
+  const char* levels[3];
+};
+
+constexpr keyboard_layout keyboard_layouts[] = {
+  {"us", {
+    "`1234567890-=" "qwertyuiop[]" "asdfghjkl;'\\" " zxcvbnm,./",
+    "~!@#$%^&*()_+" "QWERTYUIOP{}" "ASDFGHJKL:\"|" " ZXCVBNM<>?",
+    ""}},
+  {"uk", {
+    "`1234567890-=" "qwertyuiop[]" "asdfghjkl;'#" "\\zxcvbnm,./",
+    "¬!\"£$%^&*()_+" "QWERTYUIOP{}" "ASDFGHJKL:@~" "|ZXCVBNM<>?",
+    "|   €"}},
+  {"de", {
+    "\u03021234567890ß\u0301" "qwertzuiopü+" "asdfghjklöä#" "<yxcvbnm,.-",
+    "°!\"§$%&/()=?\u0300" "QWERTZUIOPÜ*" "ASDFGHJKLÖÄ'" ">YXCVBNM;:_",
+    "  ²³   {[]}\\ " "@ €        ~" "            " "|      µ"}},
+  {"fr", {
+    "²&é\"'(-è_çà)=" "azertyuiop\u0302$" "qsdfghjklmù*" "<wxcvbn,;:!",
+    " 1234567890°+" "AZERTYUIOP\u0308£" "QSDFGHJKLM%µ" ">WXCVBN?./§",
+    "  ~#{[|`\\^@]}" "  €"}},
+  {"es", {
+    "º1234567890'¡" "qwertyuiop\u0300+" "asdfghjklñ\u0301ç" "<zxcvbnm,.-",
+    "ª!\"·$%&/()=?¿" "QWERTYUIOP\u0302*" "ASDFGHJKLÑ\u0308Ç" ">ZXCVBNM;:_",
+    "\\|@#~ ¬      " "  €       []" "          {}"}},
+};
+
+// What each dead key does to the character typed after it
+struct dead_key_accent
+{
+  Uint32 combining; // the combining accent marking this dead key in keyboard_layout
+  const char* bases;
+  const char* composed; // UTF-8, one character for each of bases
+};
+
+constexpr dead_key_accent dead_key_accents[TEXT_DEAD_KINDS] = {
+  {0, "", ""},
+  {0x300, "aeiouAEIOU ", "àèìòùÀÈÌÒÙ`"},
+  {0x301, "aeiouyAEIOUY ", "áéíóúýÁÉÍÓÚÝ´"},
+  {0x302, "aeiouAEIOU ", "âêîôûÂÊÎÔÛ^"},
+  {0x303, "anoANO ", "ãñõÃÑÕ~"},
+  {0x308, "aeiouyAEIOU ", "äëïöüÿÄËÏÖÜ¨"},
+};
+
+// The selected layout inverted, so any character it can type is found by its code point
+struct
+{
+  text_key keys[TEXT_LAYOUT_SLOTS];
+  text_key dead_keys[TEXT_DEAD_KINDS];
+} text_layout;
+
+int keyboardLayoutFromName(const char* name)
+{
+  for (int i = 0; i < (int)(sizeof(keyboard_layouts) / sizeof(keyboard_layouts[0])); i++) {
+    if (strcasecmp(name, keyboard_layouts[i].name) == 0) {
+      return i;
+    }
+  }
+  printf("unknown keyboard layout %s, using us\n", name);
+  return 0;
+}
+
+// Next code point of a UTF-8 string, or U+FFFD for a malformed sequence
+Uint32 decodeUtf8(const char*& text)
 {
-  character_set[0]=char_to_keycode("a"); //capital letters
-  character_set_shift[0]=true;
-  character_set[1]=char_to_keycode("b");
-  character_set_shift[1]=true;
-  character_set[2]=char_to_keycode("c");
-  character_set_shift[2]=true;
-  character_set[3]=char_to_keycode("d");
-  character_set_shift[3]=true;
-  character_set[4]=char_to_keycode("e");
-  character_set_shift[4]=true;
-  character_set[5]=char_to_keycode("f");
-  character_set_shift[5]=true;
-  character_set[6]=char_to_keycode("g");
-  character_set_shift[6]=true;
-  character_set[7]=char_to_keycode("h");
-  character_set_shift[7]=true;
-  character_set[8]=char_to_keycode("i");
-  character_set_shift[8]=true;
-  character_set[9]=char_to_keycode("j");
-  character_set_shift[9]=true;
-  character_set[10]=char_to_keycode("k");
-  character_set_shift[10]=true;
-  character_set[11]=char_to_keycode("l");
-  character_set_shift[11]=true;
-  character_set[12]=char_to_keycode("m");
-  character_set_shift[12]=true;
-  character_set[13]=char_to_keycode("n");
-  character_set_shift[13]=true;
-  character_set[14]=char_to_keycode("o");
-  character_set_shift[14]=true;
-  character_set[15]=char_to_keycode("p");
-  character_set_shift[15]=true;
-  character_set[16]=char_to_keycode("q");
-  character_set_shift[16]=true;
-  character_set[17]=char_to_keycode("r");
-  character_set_shift[17]=true;
-  character_set[18]=char_to_keycode("s");
-  character_set_shift[18]=true;
-  character_set[19]=char_to_keycode("t");
-  character_set_shift[19]=true;
-  character_set[20]=char_to_keycode("u");
-  character_set_shift[20]=true;
-  character_set[21]=char_to_keycode("v");
-  character_set_shift[21]=true;
-  character_set[22]=char_to_keycode("w");
-  character_set_shift[22]=true;
-  character_set[23]=char_to_keycode("x");
-  character_set_shift[23]=true;
-  character_set[24]=char_to_keycode("y");
-  character_set_shift[24]=true;
-  character_set[25]=char_to_keycode("z");
-  character_set_shift[25]=true;
-  character_set[26]=char_to_keycode("a"); //lower case
-  character_set_shift[26]=false;
-  character_set[27]=char_to_keycode("b");
-  character_set_shift[27]=false;
-  character_set[28]=char_to_keycode("c");
-  character_set_shift[28]=false;
-  character_set[29]=char_to_keycode("d");
-  character_set_shift[29]=false;
-  character_set[30]=char_to_keycode("e");
-  character_set_shift[30]=false;  
-  character_set[31]=char_to_keycode("f");
-  character_set_shift[31]=false;
-  character_set[32]=char_to_keycode("g");
-  character_set_shift[32]=false;
-  character_set[33]=char_to_keycode("h");
-  character_set_shift[33]=false;
-  character_set[34]=char_to_keycode("i");
-  character_set_shift[34]=false;
-  character_set[35]=char_to_keycode("j");
-  character_set_shift[35]=false;
-  character_set[36]=char_to_keycode("k");
-  character_set_shift[36]=false;
-  character_set[37]=char_to_keycode("l");
-  character_set_shift[37]=false;
-  character_set[38]=char_to_keycode("m");
-  character_set_shift[38]=false;
-  character_set[39]=char_to_keycode("n");
-  character_set_shift[39]=false;
-  character_set[40]=char_to_keycode("o");
-  character_set_shift[40]=false;
-  character_set[41]=char_to_keycode("p");
-  character_set_shift[41]=false;
-  character_set[42]=char_to_keycode("q");
-  character_set_shift[42]=false;
-  character_set[43]=char_to_keycode("r");
-  character_set_shift[43]=false;
-  character_set[44]=char_to_keycode("s");
-  character_set_shift[44]=false;
-  character_set[45]=char_to_keycode("t");
-  character_set_shift[45]=false;
-  character_set[46]=char_to_keycode("u");
-  character_set_shift[46]=false;
-  character_set[47]=char_to_keycode("v");
-  character_set_shift[47]=false;
-  character_set[48]=char_to_keycode("w");
-  character_set_shift[48]=false;
-  character_set[49]=char_to_keycode("x");
-  character_set_shift[49]=false;
-  character_set[50]=char_to_keycode("y");
-  character_set_shift[50]=false;
-  character_set[51]=char_to_keycode("z");
-  character_set_shift[51]=false;
-  character_set[52]=char_to_keycode("0");
-  character_set_shift[52]=false;
-  character_set[53]=char_to_keycode("1");
-  character_set_shift[53]=false;
-  character_set[54]=char_to_keycode("2");
-  character_set_shift[54]=false;
-  character_set[55]=char_to_keycode("3");
-  character_set_shift[55]=false;
-  character_set[56]=char_to_keycode("4");
-  character_set_shift[56]=false;
-  character_set[57]=char_to_keycode("5");
-  character_set_shift[57]=false;
-  character_set[58]=char_to_keycode("6");
-  character_set_shift[58]=false;
-  character_set[59]=char_to_keycode("7"); 
-  character_set_shift[59]=false;
-  character_set[60]=char_to_keycode("8"); 
-  character_set_shift[60]=false;
-  character_set[61]=char_to_keycode("9"); 
-  character_set_shift[61]=false;
-  character_set[62]=char_to_keycode("space"); 
-  character_set_shift[62]=false;
-  character_set[63]=char_to_keycode("."); 
-  character_set_shift[63]=false;
-  character_set[64]=char_to_keycode(","); 
-  character_set_shift[64]=false;
-  character_set[65]=char_to_keycode("-"); 
-  character_set_shift[65]=false;
-  character_set[66]=char_to_keycode("_"); 
-  character_set_shift[66]=true;
-  character_set[67]=char_to_keycode("("); 
-  character_set_shift[67]=true;
-  character_set[68]=char_to_keycode(")");  
-  character_set_shift[68]=true;
+  const unsigned char lead = *text++;
+  int length = 0;
+  Uint32 code_point = lead;
+  if (lead >= 0xf0 && lead < 0xf8) {
+    length = 3;
+    code_point = lead & 0x07;
+  } else if (lead >= 0xe0) {
+    length = 2;
+    code_point = lead & 0x0f;
+  } else if (lead >= 0xc0) {
+    length = 1;
+    code_point = lead & 0x1f;
+  } else if (lead >= 0x80) {
+    return 0xfffd;
+  }
+  for (int i = 0; i < length; i++) {
+    if ((*text & 0xc0) != 0x80) {
+      return 0xfffd;
+    }
+    code_point = (code_point << 6) | (*text++ & 0x3f);
+  }
+  return code_point;
+}
+
+int textLayoutSlot(Uint32 code_point)
+{
+  if (code_point >= 0x20 && code_point <= 0xff) {
+    return code_point - 0x20;
+  }
+  return code_point == 0x20ac ? TEXT_LAYOUT_EURO : -1;
+}
+
+// The key typing a character with the selected layout, or NULL if it has none
+const text_key* textKey(Uint32 code_point)
+{
+  const int slot = textLayoutSlot(code_point);
+  if (slot < 0 || text_layout.keys[slot].code == 0) {
+    return NULL;
+  }
+  return &text_layout.keys[slot];
+}
+
+void buildTextLayout()
+{
+  const keyboard_layout& layout = keyboard_layouts[config.keyboard_layout];
+  memset(&text_layout, 0, sizeof(text_layout));
+  text_layout.keys[' ' - 0x20] = {KEY_SPACE, 0, 0};
+
+  // characters typed directly, preferring the fewest modifiers
+  const Uint8 level_modifiers[3] = {0, TEXT_SHIFT, TEXT_ALTGR};
+  for (int level = 0; level < 3; level++) {
+    const char* text = layout.levels[level];
+    for (int key = 0; key < TEXT_LAYOUT_KEYS && *text != '\0'; key++) {
+      const Uint32 code_point = decodeUtf8(text);
+      const text_key typed = {layout_keycodes[key], level_modifiers[level], 0};
+      for (int dead = 1; dead < TEXT_DEAD_KINDS; dead++) {
+        if (code_point == dead_key_accents[dead].combining && text_layout.dead_keys[dead].code == 0) {
+          text_layout.dead_keys[dead] = typed;
+        }
+      }
+      const int slot = textLayoutSlot(code_point);
+      if (code_point != ' ' && slot >= 0 && text_layout.keys[slot].code == 0) {
+        text_layout.keys[slot] = typed;
+      }
+    }
+  }
+
+  // the rest through the layout's dead keys
+  for (int dead = 1; dead < TEXT_DEAD_KINDS; dead++) {
+    if (text_layout.dead_keys[dead].code == 0) continue;
+    const char* composed = dead_key_accents[dead].composed;
+    for (const char* base = dead_key_accents[dead].bases; *base != '\0'; base++) {
+      const int slot = textLayoutSlot(decodeUtf8(composed));
+      const text_key* typed = textKey((unsigned char)*base);
+      if (slot >= 0 && text_layout.keys[slot].code == 0 && typed != NULL && typed->dead == 0) {
+        text_layout.keys[slot] = *typed;
+        text_layout.keys[slot].dead = dead;
+      }
+    }
+  }
+}
 
+// Characters offered by interactive text input, in order; the symbols from '@' on only with TEXTINPUTADDEXTRASYMBOLS
+const char interactive_characters[maxKeysWithSymbols + 1] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789 .,-_()"
+  "@#%&*-+!\"':;/?~`|{}$^=[]\\<>";
+
+void initialiseCharacterSet()
+{
   if (textinputinteractive_extrasymbols) {
     maxKeys = maxKeysWithSymbols;
-    character_set[69]=char_to_keycode("@");  
-    character_set_shift[69]=true;
-    character_set[70]=char_to_keycode("#");  
-    character_set_shift[70]=true;
-    character_set[71]=char_to_keycode("%");  
-    character_set_shift[71]=true;
-    character_set[72]=char_to_keycode("&");  
-    character_set_shift[72]=true;
-    character_set[73]=char_to_keycode("*");  
-    character_set_shift[73]=true;
-    character_set[74]=char_to_keycode("-");  
-    character_set_shift[74]=false;
-    character_set[75]=char_to_keycode("+");  
-    character_set_shift[75]=true;
-    character_set[76]=char_to_keycode("!");  
-    character_set_shift[76]=true;
-    character_set[77]=char_to_keycode("\"");  
-    character_set_shift[77]=true;
-    character_set[78]=char_to_keycode("\'");  
-    character_set_shift[78]=false;
-    character_set[79]=char_to_keycode(":");  
-    character_set_shift[79]=true;
-    character_set[80]=char_to_keycode(";");  
-    character_set_shift[80]=false;
-    character_set[81]=char_to_keycode("/");  
-    character_set_shift[81]=false;
-    character_set[82]=char_to_keycode("?");  
-    character_set_shift[82]=true;
-    character_set[83]=char_to_keycode("~");  
-    character_set_shift[83]=true;
-    character_set[84]=char_to_keycode("`");  
-    character_set_shift[84]=false;
-    character_set[85]=char_to_keycode("|");  
-    character_set_shift[85]=true;
-    character_set[86]=char_to_keycode("{");  
-    character_set_shift[86]=true;
-    character_set[87]=char_to_keycode("}");  
-    character_set_shift[87]=true;
-    character_set[88]=char_to_keycode("$");  
-    character_set_shift[88]=true;
-    character_set[89]=char_to_keycode("^");  
-    character_set_shift[89]=true;
-    character_set[90]=char_to_keycode("=");  
-    character_set_shift[90]=false;
-    character_set[91]=char_to_keycode("[");  
-    character_set_shift[91]=false;
-    character_set[92]=char_to_keycode("]");  
-    character_set_shift[92]=false;
-    character_set[93]=char_to_keycode("\\");  
-    character_set_shift[93]=false;
-    character_set[94]=char_to_keycode("<");  
-    character_set_shift[94]=true;
-    character_set[95]=char_to_keycode(">");  
-    character_set_shift[95]=true;
+  }
+  for (int ii = 0; ii < maxKeys; ii++) {
+    const text_key* key = textKey(interactive_characters[ii]);
+    if (key != NULL) {
+      character_set[ii] = *key;
+    } else {
+      printf("keyboard layout can't type %c\n", interactive_characters[ii]);
+      character_set[ii] = {KEY_SPACE, 0, 0};
+    }
   }
   initialiseCharacters();
 }
 
+// Buttons that can run a macro or have a dual-role mapping, with their normal key mapping
+struct button_mapping
+{
+  const char* name;
+  int button;
+  short* key;
+  short* modifier;
+};
+
+const button_mapping* buttonMapping(int button)
+{
+  static const button_mapping mappings[] = {
+    {"a", SDL_CONTROLLER_BUTTON_A, &config.a, &config.a_modifier},
+    {"b", SDL_CONTROLLER_BUTTON_B, &config.b, &config.b_modifier},
+    {"x", SDL_CONTROLLER_BUTTON_X, &config.x, &config.x_modifier},
+    {"y", SDL_CONTROLLER_BUTTON_Y, &config.y, &config.y_modifier},
+    {"l1", SDL_CONTROLLER_BUTTON_LEFTSHOULDER, &config.l1, &config.l1_modifier},
+    {"r1", SDL_CONTROLLER_BUTTON_RIGHTSHOULDER, &config.r1, &config.r1_modifier},
+    {"l3", SDL_CONTROLLER_BUTTON_LEFTSTICK, &config.l3, &config.l3_modifier},
+    {"r3", SDL_CONTROLLER_BUTTON_RIGHTSTICK, &config.r3, &config.r3_modifier},
+    {"up", SDL_CONTROLLER_BUTTON_DPAD_UP, &config.up, &config.up_modifier},
+    {"down", SDL_CONTROLLER_BUTTON_DPAD_DOWN, &config.down, &config.down_modifier},
+    {"left", SDL_CONTROLLER_BUTTON_DPAD_LEFT, &config.left, &config.left_modifier},
+    {"right", SDL_CONTROLLER_BUTTON_DPAD_RIGHT, &config.right, &config.right_modifier},
+    {"back", SDL_CONTROLLER_BUTTON_BACK, &config.back, &config.back_modifier},
+    {"guide", SDL_CONTROLLER_BUTTON_GUIDE, &config.guide, &config.guide_modifier},
+    {NULL, SDL_CONTROLLER_BUTTON_INVALID, NULL, NULL},
+  };
+
+  const button_mapping* m = mappings;
+  while (m->name != NULL && m->button != button) m++;
+  return m;
+}
+
+// gptk button name, optionally followed by suffix (e.g. "a_hold"), to SDL button
+int buttonFromString(const char* str, const char* suffix = "")
+{
+  for (int button = 0; button < SDL_CONTROLLER_BUTTON_MAX; button++) {
+    const button_mapping* m = buttonMapping(button);
+    const size_t len = m->name ? strlen(m->name) : 0;
+    if (m->name != NULL && strncmp(str, m->name, len) == 0 && strcmp(str + len, suffix) == 0) {
+      return button;
+    }
+  }
+  return SDL_CONTROLLER_BUTTON_INVALID;
+}
+
+bool addMacroStep(unsigned char action, unsigned short value)
+{
+  if (macros.step_count == MACRO_STEPS_MAX) {
+    return false;
+  }
+  macros.steps[macros.step_count].action = action;
+  macros.steps[macros.step_count].value = value;
+  macros.step_count++;
+  return true;
+}
+
+// Compile a comma separated macro definition: "+key" presses a key, "-key"
+// releases it, "key" taps it (press, MACRO_TAP_DELAY, release) and "delayN"
+// waits N ms, e.g. macro1 = +leftctrl,c,-leftctrl,delay100,enter
+void compileMacro(int number, const char* definition)
+{
+  if (number < 1 || number > MACRO_MAX) {
+    printf("ignoring macro%d, macros are numbered 1 to %d\n", number, MACRO_MAX);
+    return;
+  }
+
+  char buffer[CONFIG_ARG_MAX_BYTES];
+  strncpy(buffer, definition, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+
+  macros.start[number] = macros.step_count;
+  bool fits = true;
+  bool known = true;
+  char* saveptr = NULL;
+  for (char* token = strtok_r(buffer, ",", &saveptr); token != NULL && fits && known; token = strtok_r(NULL, ",", &saveptr)) {
+    if (strncmp(token, "delay", 5) == 0) {
+      fits = addMacroStep(MACRO_DELAY, atoi(token + 5));
+      continue;
+    }
+    const bool press = token[0] == '+' && token[1] != '\0';
+    const bool release = token[0] == '-' && token[1] != '\0';
+    const char* name = (press || release) ? token + 1 : token;
+    const short code = char_to_keycode(name);
+    if (code == 0) {
+      printf("ignoring macro%d, unknown key %s\n", number, name);
+      known = false;
+    } else if (press) {
+      fits = addMacroStep(MACRO_PRESS, code);
+    } else if (release) {
+      fits = addMacroStep(MACRO_RELEASE, code);
+    } else {
+      fits = addMacroStep(MACRO_PRESS, code) && addMacroStep(MACRO_DELAY, MACRO_TAP_DELAY) &&
+        addMacroStep(MACRO_RELEASE, code);
+    }
+  }
+
+  if (!fits) {
+    printf("ignoring macro%d, all macros together are limited to %d steps\n", number, MACRO_STEPS_MAX);
+  }
+  if (!fits || !known) {
+    macros.step_count = macros.start[number];
+  }
+  macros.length[number] = macros.step_count - macros.start[number];
+}
+
+// touchpad_regionN = left,top,right,bottom in % of the touchpad; touchpad_regionN_key = key
+bool parseTouchpadRegion(const char* key, const char* value)
+{
+  const int region = atoi(key + 15);
+  const char* suffix = strchr(key + 15, '_');
+  if (region < 1 || region > TOUCHPAD_REGION_MAX) {
+    return false;
+  }
+  if (suffix == NULL) {
+    int* bounds = config.touchpad_region[region];
+    if (sscanf(value, "%d,%d,%d,%d", &bounds[0], &bounds[1], &bounds[2], &bounds[3]) != 4) {
+      printf("touchpad_region%d needs left,top,right,bottom\n", region);
+      memset(bounds, 0, sizeof(config.touchpad_region[region]));
+    }
+    return true;
+  }
+  if (strcmp(suffix, "_key") != 0) {
+    return false;
+  }
+  if (strcmp(value, "add_alt") == 0) {
+    config.touchpad_region_modifier[region] |= MODIFIER_ALT;
+  } else if (strcmp(value, "add_ctrl") == 0) {
+    config.touchpad_region_modifier[region] |= MODIFIER_CTRL;
+  } else if (strcmp(value, "add_shift") == 0) {
+    config.touchpad_region_modifier[region] |= MODIFIER_SHIFT;
+  } else if (const short code = char_to_keycode(value)) {
+    config.touchpad_region_key[region] = code;
+  } else {
+    printf("ignoring %s, unknown key %s\n", key, value);
+  }
+  return true;
+}
+
+// layerN = button or chord of buttons joined by '+', e.g. layer1 = l1+r1
+void parseLayerChord(int layer, const char* chord)
+{
+  char buffer[CONFIG_ARG_MAX_BYTES];
+  strncpy(buffer, chord, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+
+  config.layer_chord[layer] = 0;
+  char* saveptr = NULL;
+  for (char* token = strtok_r(buffer, "+", &saveptr); token != NULL; token = strtok_r(NULL, "+", &saveptr)) {
+    const int button = buttonFromString(token);
+    if (button == SDL_CONTROLLER_BUTTON_INVALID) {
+      printf("ignoring layer%d, %s can't be used in a layer chord\n", layer, token);
+      config.layer_chord[layer] = 0;
+      return;
+    }
+    config.layer_chord[layer] |= 1u << button;
+  }
+}
+
+// A button, or l2/r2 as LAYER_L2/LAYER_R2, that can have a key in a layer
+int layerKeyFromString(const char* str, const char* suffix = "")
+{
+  if (strncmp(str, "l2", 2) == 0 && strcmp(str + 2, suffix) == 0) {
+    return LAYER_L2;
+  } else if (strncmp(str, "r2", 2) == 0 && strcmp(str + 2, suffix) == 0) {
+    return LAYER_R2;
+  }
+  return buttonFromString(str, suffix);
+}
+
+// option is the config key, for the message if value isn't a key
+void setLayerKey(int layer, int button, const char* option, const char* value)
+{
+  if (strcmp(value, "add_alt") == 0) {
+    config.layer_modifier[layer][button] |= MODIFIER_ALT;
+  } else if (strcmp(value, "add_ctrl") == 0) {
+    config.layer_modifier[layer][button] |= MODIFIER_CTRL;
+  } else if (strcmp(value, "add_shift") == 0) {
+    config.layer_modifier[layer][button] |= MODIFIER_SHIFT;
+  } else if (const short code = char_to_keycode(value)) {
+    config.layer_key[layer][button] = code;
+  } else {
+    printf("ignoring %s, unknown key %s\n", option, value);
+  }
+}
+
+// layerN_button = key or add_alt/add_ctrl/add_shift; returns false if key isn't a layer option
+bool parseLayerKey(const char* key, const char* value)
+{
+  const int layer = atoi(key + 5);
+  const char* button_name = strchr(key, '_');
+  if (layer < 1 || layer > LAYER_MAX) {
+    return false;
+  }
+  if (button_name == NULL) {
+    parseLayerChord(layer, value);
+    return true;
+  }
+
+  const int button = layerKeyFromString(button_name + 1);
+  if (button == SDL_CONTROLLER_BUTTON_INVALID) {
+    return false;
+  }
+  setLayerKey(layer, button, key, value);
+  return true;
+}
+
+// The hotkey combinations are a layer like any other: its chord is the hotkey
+// button and its keys are the button_hk options, set here to their defaults
+void setHotkeyLayer()
+{
+  if (!hotkey_override || strcmp(hotkey_code, "guide") == 0) {
+    hotkey_button = SDL_CONTROLLER_BUTTON_GUIDE;
+  } else if (strcmp(hotkey_code, "back") == 0) {
+    hotkey_button = SDL_CONTROLLER_BUTTON_BACK;
+  } else if (strcmp(hotkey_code, "l3") == 0) {
+    hotkey_button = SDL_CONTROLLER_BUTTON_LEFTSTICK;
+  } else {
+    hotkey_button = SDL_CONTROLLER_BUTTON_INVALID;
+  }
+  config.layer_chord[LAYER_HOTKEY] = hotkey_button != SDL_CONTROLLER_BUTTON_INVALID ? 1u << hotkey_button : 0;
+
+  short* keys = config.layer_key[LAYER_HOTKEY];
+  keys[SDL_CONTROLLER_BUTTON_A] = KEY_ENTER;
+  keys[SDL_CONTROLLER_BUTTON_B] = KEY_ESC;
+  keys[SDL_CONTROLLER_BUTTON_X] = KEY_C;
+  keys[SDL_CONTROLLER_BUTTON_Y] = KEY_A;
+  keys[SDL_CONTROLLER_BUTTON_LEFTSHOULDER] = KEY_ESC;
+  keys[SDL_CONTROLLER_BUTTON_RIGHTSHOULDER] = KEY_ENTER;
+  keys[LAYER_L2] = KEY_HOME;
+  keys[LAYER_R2] = KEY_END;
+}
+
+// Some controllers report one button as both BACK and GUIDE. With the GUIDE
+// hotkey, BACK then stands in for it and the GUIDE events are dropped, so the
+// button still sends its back key when it isn't used for a combination
+bool backIsHotkey(SDL_GameController* controller)
+{
+  return hotkey_button == SDL_CONTROLLER_BUTTON_GUIDE &&
+    SDL_GameControllerGetBindForButton(controller, SDL_CONTROLLER_BUTTON_BACK).value.button ==
+    SDL_GameControllerGetBindForButton(controller, SDL_CONTROLLER_BUTTON_GUIDE).value.button;
+}
+
+// Build the compact chord table: every combination of held chord buttons maps
+// to the layer with the most specific chord it contains (lowest number wins ties)
+void buildLayerTable()
+{
+  int bits = 0;
+  Uint32 compact_chord[LAYER_COUNT] = {};
+  // the hotkey layer gets its chord bit first, so other layers can't crowd it out
+  for (int n = 0; n <= LAYER_MAX; n++) {
+    const int layer = n == 0 ? LAYER_HOTKEY : n;
+    if (config.layer_chord[layer] == 0) {
+      continue;
+    }
+    int new_bits = 0; // buttons this chord adds, checked before any get a bit
+    for (int button = 0; button < SDL_CONTROLLER_BUTTON_MAX; button++) {
+      if ((config.layer_chord[layer] & (1u << button)) && layers.chord_bit[button] == 0) {
+        new_bits++;
+      }
+    }
+    if (bits + new_bits > LAYER_CHORD_BITS) {
+      printf("ignoring layer%d, layer chords can use at most %d different buttons\n", layer, LAYER_CHORD_BITS);
+      config.layer_chord[layer] = 0;
+      continue;
+    }
+    for (int button = 0; button < SDL_CONTROLLER_BUTTON_MAX; button++) {
+      if (!(config.layer_chord[layer] & (1u << button))) {
+        continue;
+      }
+      if (layers.chord_bit[button] == 0) {
+        layers.chord_bit[button] = 1u << bits++;
+      }
+      compact_chord[layer] |= layers.chord_bit[button];
+    }
+  }
+
+  for (unsigned int held = 0; held < (1u << bits); held++) {
+    int best_layer = 0;
+    int best_size = 0;
+    for (int layer = 1; layer < LAYER_COUNT; layer++) {
+      const int size = __builtin_popcount(compact_chord[layer]);
+      if (compact_chord[layer] != 0 && (compact_chord[layer] & held) == compact_chord[layer] && size > best_size) {
+        best_layer = layer;
+        best_size = size;
+      }
+    }
+    layers.active_layer[held] = best_layer;
+  }
+}
+
+int analogModeFromString(const char* str)
+{
+  if (strcmp(str, "4way") == 0) {
+    return ANALOG_MODE_4WAY;
+  } else if (strcmp(str, "8way") == 0) {
+    return ANALOG_MODE_8WAY;
+  }
+  return ANALOG_MODE_AXIS;
+}
+
+// Precompute the 8-way diagonal sector boundaries as fixed point slopes, so
+// classifying a stick position only needs integer multiplies
+void setAnalogSectors()
+{
+  if (config.analog_diagonal_width < 0) config.analog_diagonal_width = 0;
+  if (config.analog_diagonal_width > 89) config.analog_diagonal_width = 89;
+
+  const double half_width = config.analog_diagonal_width * M_PI / 360.0;
+  config.analog_diagonal_slope_low = lround(tan(M_PI / 4 - half_width) * ANALOG_SLOPE_ONE);
+  config.analog_diagonal_slope_high = lround(tan(M_PI / 4 + half_width) * ANALOG_SLOPE_ONE);
+}
+
+// Classify a stick into a set of ANALOG_DIR_* flags. In axis mode X and Y are
+// evaluated independently as before; in 4-way/8-way mode the raw stick vector is
+// assigned to a sector by comparing its slope against the precomputed sector
+// boundaries, so no trigonometry is needed per event.
+int analogDirections(int x, int y, int raw_x, int raw_y, int mode)
+{
+  if (mode == ANALOG_MODE_AXIS) {
+    return (y < 0 ? ANALOG_DIR_UP : 0) | (y > 0 ? ANALOG_DIR_DOWN : 0) |
+      (x < 0 ? ANALOG_DIR_LEFT : 0) | (x > 0 ? ANALOG_DIR_RIGHT : 0);
+  }
+
+  if (x == 0 && y == 0) { // inside the deadzone (with hysteresis) on both axes
+    return 0;
+  }
+
+  const long long abs_x = std::abs(raw_x);
+  const long long abs_y = std::abs(raw_y);
+  const int horizontal = raw_x < 0 ? ANALOG_DIR_LEFT : ANALOG_DIR_RIGHT;
+  const int vertical = raw_y < 0 ? ANALOG_DIR_UP : ANALOG_DIR_DOWN;
+  const int slope_low = (mode == ANALOG_MODE_8WAY) ? config.analog_diagonal_slope_low : ANALOG_SLOPE_ONE;
+  const int slope_high = (mode == ANALOG_MODE_8WAY) ? config.analog_diagonal_slope_high : ANALOG_SLOPE_ONE;
+
+  if (abs_y * ANALOG_SLOPE_ONE <= abs_x * slope_low) {
+    return horizontal;
+  } else if (abs_y * ANALOG_SLOPE_ONE > abs_x * slope_high) {
+    return vertical;
+  }
+  return horizontal | vertical;
+}
+
+// deadzone_up, deadzone_down, deadzone_left, deadzone_right, deadzone_l2 and
+// deadzone_r2, each with an optional _release suffix
+bool parseDirectionDeadzone(const char* key, const char* value)
+{
+  const struct
+  {
+    const char* name;
+    analog_threshold& threshold;
+  } directions[] = {
+    {"deadzone_up", config.deadzone_up},
+    {"deadzone_down", config.deadzone_down},
+    {"deadzone_left", config.deadzone_left},
+    {"deadzone_right", config.deadzone_right},
+    {"deadzone_l2", config.deadzone_l2},
+    {"deadzone_r2", config.deadzone_r2},
+  };
+  for (const auto& direction : directions) {
+    const size_t length = strlen(direction.name);
+    if (strncmp(key, direction.name, length) != 0) {
+      continue;
+    }
+    if (key[length] == '\0') {
+      direction.threshold.engage = atoi(value);
+      return true;
+    } else if (strcmp(key + length, "_release") == 0) {
+      direction.threshold.release = atoi(value);
+      return true;
+    }
+  }
+  return false;
+}
+
 void readConfigFile(const char* config_file)
 {
   const auto parsedConfig = parseConfigFile(config_file);
   for (const auto& co : parsedConfig) {
-    if (strcmp(co.key, "back") == 0) {
-        if (strcmp(co.value, "repeat") == 0) {
-            config.back_repeat = true;
+    if ((strncmp(co.key, "layer", 5) == 0) && parseLayerKey(co.key, co.value)) {
+      continue;
+    } else if (strncmp(co.key, "macro", 5) == 0) {
+      compileMacro(atoi(co.key + 5), co.value);
+      continue;
+    } else if ((strncmp(co.key, "touchpad_region", 15) == 0) && parseTouchpadRegion(co.key, co.value)) {
+      continue;
+    } else if ((strncmp(co.key, "deadzone_", 9) == 0) && parseDirectionDeadzone(co.key, co.value)) {
+      continue;
+    } else if (layerKeyFromString(co.key, "_hk") != SDL_CONTROLLER_BUTTON_INVALID) {
+      setLayerKey(LAYER_HOTKEY, layerKeyFromString(co.key, "_hk"), co.key, co.value);
+      continue;
+    } else if (buttonFromString(co.key, "_hold") != SDL_CONTROLLER_BUTTON_INVALID) {
+      const int button = buttonFromString(co.key, "_hold");
+      if (strcmp(co.value, "add_alt") == 0) {
+        config.button_hold_modifier[button] |= MODIFIER_ALT;
+      } else if (strcmp(co.value, "add_ctrl") == 0) {
+        config.button_hold_modifier[button] |= MODIFIER_CTRL;
+      } else if (strcmp(co.value, "add_shift") == 0) {
+        config.button_hold_modifier[button] |= MODIFIER_SHIFT;
+      } else {
+        config.button_hold[button] = char_to_keycode(co.value);
+      }
+      continue;
+    } else if (buttonFromString(co.key, "_turbo") != SDL_CONTROLLER_BUTTON_INVALID) {
+      const int rate = atoi(co.value);
+      config.button_turbo[buttonFromString(co.key, "_turbo")] = rate < 0 ? 0 : (rate > 1000 ? 1000 : rate);
+      continue;
+    } else if (buttonFromString(co.key, "_turbo_duty") != SDL_CONTROLLER_BUTTON_INVALID) {
+      const int duty = atoi(co.value);
+      config.button_turbo_duty[buttonFromString(co.key, "_turbo_duty")] = duty < 1 ? 1 : (duty > 100 ? 100 : duty);
+      continue;
+    } else if ((strncmp(co.value, "macro", 5) == 0) && (buttonFromString(co.key) != SDL_CONTROLLER_BUTTON_INVALID)) {
+      const int number = atoi(co.value + 5);
+      if (number >= 1 && number <= MACRO_MAX) {
+        config.button_macro[buttonFromString(co.key)] = number;
+      }
+      continue;
+    }
+
+    if (strcmp(co.key, "back") == 0) {
+        if (strcmp(co.value, "repeat") == 0) {
+            config.back_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.back_modifier = KEY_LEFTALT;
+            config.back_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.back_modifier = KEY_LEFTCTRL;
+            config.back_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.back_modifier = KEY_LEFTSHIFT;
+            config.back_modifier |= MODIFIER_SHIFT;
         } else {
             config.back = char_to_keycode(co.value);
         }
@@ -756,11 +1601,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.guide_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.guide_modifier = KEY_LEFTALT;
+            config.guide_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.guide_modifier = KEY_LEFTCTRL;
+            config.guide_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.guide_modifier = KEY_LEFTSHIFT;
+            config.guide_modifier |= MODIFIER_SHIFT;
         } else {
             config.guide = char_to_keycode(co.value);
         }
@@ -768,11 +1613,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.start_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.start_modifier = KEY_LEFTALT;
+            config.start_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.start_modifier = KEY_LEFTCTRL;
+            config.start_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.start_modifier = KEY_LEFTSHIFT;
+            config.start_modifier |= MODIFIER_SHIFT;
         } else {
             config.start = char_to_keycode(co.value);
         }
@@ -780,143 +1625,83 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.a_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.a_modifier = KEY_LEFTALT;
+            config.a_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.a_modifier = KEY_LEFTCTRL;
+            config.a_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.a_modifier = KEY_LEFTSHIFT;
+            config.a_modifier |= MODIFIER_SHIFT;
         } else {
             config.a = char_to_keycode(co.value);
         }
-    } else if (strcmp(co.key, "a_hk") == 0) {
-        if (strcmp(co.value, "add_alt") == 0) {
-            config.a_hk_modifier = KEY_LEFTALT;
-        } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.a_hk_modifier = KEY_LEFTCTRL;
-        } else if (strcmp(co.value, "add_shift") == 0) {
-            config.a_hk_modifier = KEY_LEFTSHIFT;
-        } else {
-            config.a_hk = char_to_keycode(co.value);
-        }
     } else if (strcmp(co.key, "b") == 0) {
         if (strcmp(co.value, "repeat") == 0) {
             config.b_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.b_modifier = KEY_LEFTALT;
+            config.b_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.b_modifier = KEY_LEFTCTRL;
+            config.b_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.b_modifier = KEY_LEFTSHIFT;
+            config.b_modifier |= MODIFIER_SHIFT;
         } else {
             config.b = char_to_keycode(co.value);
         }
-    } else if (strcmp(co.key, "b_hk") == 0) {
-        if (strcmp(co.value, "add_alt") == 0) {
-            config.b_hk_modifier = KEY_LEFTALT;
-        } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.b_hk_modifier = KEY_LEFTCTRL;
-        } else if (strcmp(co.value, "add_shift") == 0) {
-            config.b_hk_modifier = KEY_LEFTSHIFT;
-        } else {
-            config.b_hk = char_to_keycode(co.value);
-        }
     } else if (strcmp(co.key, "x") == 0) {
         if (strcmp(co.value, "repeat") == 0) {
             config.x_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.x_modifier = KEY_LEFTALT;
+            config.x_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.x_modifier = KEY_LEFTCTRL;
+            config.x_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.x_modifier = KEY_LEFTSHIFT;
+            config.x_modifier |= MODIFIER_SHIFT;
         } else {
             config.x = char_to_keycode(co.value);
         }
-    } else if (strcmp(co.key, "x_hk") == 0) {
-        if (strcmp(co.value, "add_alt") == 0) {
-            config.x_hk_modifier = KEY_LEFTALT;
-        } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.x_hk_modifier = KEY_LEFTCTRL;
-        } else if (strcmp(co.value, "add_shift") == 0) {
-            config.x_hk_modifier = KEY_LEFTSHIFT;
-        } else {
-            config.x_hk = char_to_keycode(co.value);
-        }
     } else if (strcmp(co.key, "y") == 0) {
         if (strcmp(co.value, "repeat") == 0) {
             config.y_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.y_modifier = KEY_LEFTALT;
+            config.y_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.y_modifier = KEY_LEFTCTRL;
+            config.y_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.y_modifier = KEY_LEFTSHIFT;
+            config.y_modifier |= MODIFIER_SHIFT;
         } else {
             config.y = char_to_keycode(co.value);
         }
-    } else if (strcmp(co.key, "y_hk") == 0) {
-        if (strcmp(co.value, "add_alt") == 0) {
-            config.y_hk_modifier = KEY_LEFTALT;
-        } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.y_hk_modifier = KEY_LEFTCTRL;
-        } else if (strcmp(co.value, "add_shift") == 0) {
-            config.y_hk_modifier = KEY_LEFTSHIFT;
-        } else {
-            config.y_hk = char_to_keycode(co.value);
-        }
     } else if (strcmp(co.key, "l1") == 0) {
         if (strcmp(co.value, "repeat") == 0) {
             config.l1_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.l1_modifier = KEY_LEFTALT;
+            config.l1_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.l1_modifier = KEY_LEFTCTRL;
+            config.l1_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.l1_modifier = KEY_LEFTSHIFT;
+            config.l1_modifier |= MODIFIER_SHIFT;
         } else {
             config.l1 = char_to_keycode(co.value);
         }
-    } else if (strcmp(co.key, "l1_hk") == 0) {
-        if (strcmp(co.value, "add_alt") == 0) {
-            config.l1_hk_modifier = KEY_LEFTALT;
-        } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.l1_hk_modifier = KEY_LEFTCTRL;
-        } else if (strcmp(co.value, "add_shift") == 0) {
-            config.l1_hk_modifier = KEY_LEFTSHIFT;
-        } else {
-            config.l1_hk = char_to_keycode(co.value);
-        }
     } else if (strcmp(co.key, "l2") == 0) {
         if (strcmp(co.value, "repeat") == 0) {
             config.l2_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.l2_modifier = KEY_LEFTALT;
+            config.l2_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.l2_modifier = KEY_LEFTCTRL;
+            config.l2_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.l2_modifier = KEY_LEFTSHIFT;
+            config.l2_modifier |= MODIFIER_SHIFT;
         } else {
             config.l2 = char_to_keycode(co.value);
         }
-    } else if (strcmp(co.key, "l2_hk") == 0) {
-        if (strcmp(co.value, "add_alt") == 0) {
-            config.l2_hk_modifier = KEY_LEFTALT;
-        } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.l2_hk_modifier = KEY_LEFTCTRL;
-        } else if (strcmp(co.value, "add_shift") == 0) {
-            config.l2_hk_modifier = KEY_LEFTSHIFT;
-        } else {
-            config.l2_hk = char_to_keycode(co.value);
-        }
     } else if (strcmp(co.key, "l3") == 0) {
         if (strcmp(co.value, "repeat") == 0) {
             config.l3_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.l3_modifier = KEY_LEFTALT;
+            config.l3_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.l3_modifier = KEY_LEFTCTRL;
+            config.l3_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.l3_modifier = KEY_LEFTSHIFT;
+            config.l3_modifier |= MODIFIER_SHIFT;
         } else {
             config.l3 = char_to_keycode(co.value);
         }
@@ -924,55 +1709,35 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.r1_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.r1_modifier = KEY_LEFTALT;
+            config.r1_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.r1_modifier = KEY_LEFTCTRL;
+            config.r1_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.r1_modifier = KEY_LEFTSHIFT;
+            config.r1_modifier |= MODIFIER_SHIFT;
         } else {
             config.r1 = char_to_keycode(co.value);
         }
-    } else if (strcmp(co.key, "r1_hk") == 0) {
-        if (strcmp(co.value, "add_alt") == 0) {
-            config.r1_hk_modifier = KEY_LEFTALT;
-        } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.r1_hk_modifier = KEY_LEFTCTRL;
-        } else if (strcmp(co.value, "add_shift") == 0) {
-            config.r1_hk_modifier = KEY_LEFTSHIFT;
-        } else {
-            config.r1_hk = char_to_keycode(co.value);
-        }
     } else if (strcmp(co.key, "r2") == 0) {
         if (strcmp(co.value, "repeat") == 0) {
             config.r2_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.r2_modifier = KEY_LEFTALT;
+            config.r2_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.r2_modifier = KEY_LEFTCTRL;
+            config.r2_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.r2_modifier = KEY_LEFTSHIFT;
+            config.r2_modifier |= MODIFIER_SHIFT;
         } else {
             config.r2 = char_to_keycode(co.value);
         }
-    } else if (strcmp(co.key, "r2_hk") == 0) {
-        if (strcmp(co.value, "add_alt") == 0) {
-            config.r2_hk_modifier = KEY_LEFTALT;
-        } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.r2_hk_modifier = KEY_LEFTCTRL;
-        } else if (strcmp(co.value, "add_shift") == 0) {
-            config.r2_hk_modifier = KEY_LEFTSHIFT;
-        } else {
-            config.r2_hk = char_to_keycode(co.value);
-        }
     } else if (strcmp(co.key, "r3") == 0) {
         if (strcmp(co.value, "repeat") == 0) {
             config.r3_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.r3_modifier = KEY_LEFTALT;
+            config.r3_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.r3_modifier = KEY_LEFTCTRL;
+            config.r3_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.r3_modifier = KEY_LEFTSHIFT;
+            config.r3_modifier |= MODIFIER_SHIFT;
         } else {
             config.r3 = char_to_keycode(co.value);
         }
@@ -980,11 +1745,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.up_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.up_modifier = KEY_LEFTALT;
+            config.up_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.up_modifier = KEY_LEFTCTRL;
+            config.up_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.up_modifier = KEY_LEFTSHIFT;
+            config.up_modifier |= MODIFIER_SHIFT;
         } else {
             config.up = char_to_keycode(co.value);
         }
@@ -992,11 +1757,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.down_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.down_modifier = KEY_LEFTALT;
+            config.down_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.down_modifier = KEY_LEFTCTRL;
+            config.down_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.down_modifier = KEY_LEFTSHIFT;
+            config.down_modifier |= MODIFIER_SHIFT;
         } else {
             config.down = char_to_keycode(co.value);
         }
@@ -1004,11 +1769,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.left_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.left_modifier = KEY_LEFTALT;
+            config.left_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.left_modifier = KEY_LEFTCTRL;
+            config.left_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.left_modifier = KEY_LEFTSHIFT;
+            config.left_modifier |= MODIFIER_SHIFT;
         } else {
             config.left = char_to_keycode(co.value);
         }
@@ -1016,26 +1781,28 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.right_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.right_modifier = KEY_LEFTALT;
+            config.right_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.right_modifier = KEY_LEFTCTRL;
+            config.right_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.right_modifier = KEY_LEFTSHIFT;
+            config.right_modifier |= MODIFIER_SHIFT;
         } else {
             config.right = char_to_keycode(co.value);
         }
     } else if (strcmp(co.key, "left_analog_up") == 0) {
       if (strcmp(co.value, "mouse_movement_up") == 0) {
         config.left_analog_as_mouse = true;
+      } else if (strcmp(co.value, "mouse_wheel_up") == 0) {
+        config.left_analog_as_wheel = true;
       } else {
         if (strcmp(co.value, "repeat") == 0) {
             config.left_analog_up_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.left_analog_up_modifier = KEY_LEFTALT;
+            config.left_analog_up_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.left_analog_up_modifier = KEY_LEFTCTRL;
+            config.left_analog_up_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.left_analog_up_modifier = KEY_LEFTSHIFT;
+            config.left_analog_up_modifier |= MODIFIER_SHIFT;
         } else {
             config.left_analog_up = char_to_keycode(co.value);
         }
@@ -1044,11 +1811,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.left_analog_down_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.left_analog_down_modifier = KEY_LEFTALT;
+            config.left_analog_down_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.left_analog_down_modifier = KEY_LEFTCTRL;
+            config.left_analog_down_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.left_analog_down_modifier = KEY_LEFTSHIFT;
+            config.left_analog_down_modifier |= MODIFIER_SHIFT;
         } else {
             config.left_analog_down = char_to_keycode(co.value);
         }
@@ -1056,11 +1823,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.left_analog_left_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.left_analog_left_modifier = KEY_LEFTALT;
+            config.left_analog_left_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.left_analog_left_modifier = KEY_LEFTCTRL;
+            config.left_analog_left_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.left_analog_left_modifier = KEY_LEFTSHIFT;
+            config.left_analog_left_modifier |= MODIFIER_SHIFT;
         } else {
             config.left_analog_left = char_to_keycode(co.value);
         }
@@ -1068,26 +1835,28 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.left_analog_right_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.left_analog_right_modifier = KEY_LEFTALT;
+            config.left_analog_right_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.left_analog_right_modifier = KEY_LEFTCTRL;
+            config.left_analog_right_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.left_analog_right_modifier = KEY_LEFTSHIFT;
+            config.left_analog_right_modifier |= MODIFIER_SHIFT;
         } else {
             config.left_analog_right = char_to_keycode(co.value);
         }
     } else if (strcmp(co.key, "right_analog_up") == 0) {
       if (strcmp(co.value, "mouse_movement_up") == 0) {
         config.right_analog_as_mouse = true;
+      } else if (strcmp(co.value, "mouse_wheel_up") == 0) {
+        config.right_analog_as_wheel = true;
       } else {
         if (strcmp(co.value, "repeat") == 0) {
             config.right_analog_up_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.right_analog_up_modifier = KEY_LEFTALT;
+            config.right_analog_up_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.right_analog_up_modifier = KEY_LEFTCTRL;
+            config.right_analog_up_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.right_analog_up_modifier = KEY_LEFTSHIFT;
+            config.right_analog_up_modifier |= MODIFIER_SHIFT;
         } else {
             config.right_analog_up = char_to_keycode(co.value);
         }
@@ -1096,11 +1865,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.right_analog_down_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.right_analog_down_modifier = KEY_LEFTALT;
+            config.right_analog_down_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.right_analog_down_modifier = KEY_LEFTCTRL;
+            config.right_analog_down_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.right_analog_down_modifier = KEY_LEFTSHIFT;
+            config.right_analog_down_modifier |= MODIFIER_SHIFT;
         } else {
             config.right_analog_down = char_to_keycode(co.value);
         }
@@ -1108,11 +1877,11 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.right_analog_left_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.right_analog_left_modifier = KEY_LEFTALT;
+            config.right_analog_left_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.right_analog_left_modifier = KEY_LEFTCTRL;
+            config.right_analog_left_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.right_analog_left_modifier = KEY_LEFTSHIFT;
+            config.right_analog_left_modifier |= MODIFIER_SHIFT;
         } else {
             config.right_analog_left = char_to_keycode(co.value);
         }
@@ -1120,39 +1889,139 @@ void readConfigFile(const char* config_file)
         if (strcmp(co.value, "repeat") == 0) {
             config.right_analog_right_repeat = true;
         } else if (strcmp(co.value, "add_alt") == 0) {
-            config.right_analog_right_modifier = KEY_LEFTALT;
+            config.right_analog_right_modifier |= MODIFIER_ALT;
         } else if (strcmp(co.value, "add_ctrl") == 0) {
-            config.right_analog_right_modifier = KEY_LEFTCTRL;
+            config.right_analog_right_modifier |= MODIFIER_CTRL;
         } else if (strcmp(co.value, "add_shift") == 0) {
-            config.right_analog_right_modifier = KEY_LEFTSHIFT;
+            config.right_analog_right_modifier |= MODIFIER_SHIFT;
         } else {
             config.right_analog_right = char_to_keycode(co.value);
         }
+    } else if (strcmp(co.key, "left_analog_mode") == 0) {
+      config.left_analog_mode = analogModeFromString(co.value);
+    } else if (strcmp(co.key, "right_analog_mode") == 0) {
+      config.right_analog_mode = analogModeFromString(co.value);
+    } else if (strcmp(co.key, "analog_diagonal_width") == 0) {
+      config.analog_diagonal_width = atoi(co.value);
     } else if (strcmp(co.key, "deadzone_y") == 0) {
       config.deadzone_y = atoi(co.value);
     } else if (strcmp(co.key, "deadzone_x") == 0) {
       config.deadzone_x = atoi(co.value);
     } else if (strcmp(co.key, "deadzone_triggers") == 0) {
       config.deadzone_triggers = atoi(co.value);
+    } else if (strcmp(co.key, "deadzone_y_release") == 0) {
+      config.deadzone_y_release = atoi(co.value);
+    } else if (strcmp(co.key, "deadzone_x_release") == 0) {
+      config.deadzone_x_release = atoi(co.value);
+    } else if (strcmp(co.key, "deadzone_triggers_release") == 0) {
+      config.deadzone_triggers_release = atoi(co.value);
     } else if (strcmp(co.key, "mouse_scale") == 0) {
       config.fake_mouse_scale = atoi(co.value);
     } else if (strcmp(co.key, "mouse_delay") == 0) {
       config.fake_mouse_delay = atoi(co.value);
+    } else if (strcmp(co.key, "type_rate") == 0) {
+      config.type_rate = std::max(1, atoi(co.value));
+    } else if (strcmp(co.key, "type_burst") == 0) {
+      config.type_burst = std::max(1, atoi(co.value));
+    } else if (strcmp(co.key, "keyboard_layout") == 0) {
+      config.keyboard_layout = keyboardLayoutFromName(co.value);
+    } else if (strcmp(co.key, "power_save") == 0) {
+      config.power_save = (strcmp(co.value, "true") == 0);
+    } else if (strcmp(co.key, "mouse_wheel_scale") == 0) {
+      config.mouse_wheel_scale = atoi(co.value) > 0 ? atoi(co.value) : 1;
     } else if (strcmp(co.key, "repeat_delay") == 0) {
       config.key_repeat_delay = atoi(co.value);
     } else if (strcmp(co.key, "repeat_interval") == 0) {
       config.key_repeat_interval = atoi(co.value);
+    } else if (strcmp(co.key, "hold_delay") == 0) {
+      config.hold_delay = atoi(co.value);
+    } else if (strcmp(co.key, "turbo_duty") == 0) {
+      config.turbo_duty = atoi(co.value);
+      if (config.turbo_duty < 1) config.turbo_duty = 1;
+      if (config.turbo_duty > 100) config.turbo_duty = 100;
+    } else if (strcmp(co.key, "gyro") == 0) {
+      config.gyro_mouse = (strcmp(co.value, "mouse") == 0);
+    } else if (strcmp(co.key, "gyro_button") == 0) {
+      config.gyro_button = buttonFromString(co.value);
+    } else if (strcmp(co.key, "gyro_sensitivity") == 0) {
+      config.gyro_sensitivity = atof(co.value);
+    } else if (strcmp(co.key, "gyro_sensitivity_max") == 0) {
+      config.gyro_sensitivity_max = atof(co.value);
+    } else if (strcmp(co.key, "gyro_accel_speed") == 0) {
+      config.gyro_accel_speed = atof(co.value);
+    } else if (strcmp(co.key, "gyro_smoothing") == 0) {
+      config.gyro_smoothing = atof(co.value);
+    } else if (strcmp(co.key, "gyro_calibration") == 0) {
+      config.gyro_calibration = atoi(co.value);
+    } else if (strcmp(co.key, "touchpad") == 0) {
+      config.touchpad_mouse = (strcmp(co.value, "mouse") == 0);
+    } else if (strcmp(co.key, "touchpad_sensitivity") == 0) {
+      config.touchpad_sensitivity = atof(co.value);
+    } else if (strcmp(co.key, "touchpad_scroll_sensitivity") == 0) {
+      config.touchpad_scroll_sensitivity = atof(co.value);
+    } else if (strcmp(co.key, "touchpad_tap") == 0) {
+      config.touchpad_tap = (strcmp(co.value, "true") == 0);
+    } else if (strcmp(co.key, "mouse_absolute") == 0) {
+      if (strcmp(co.value, "velocity") == 0) {
+        config.mouse_absolute = MOUSE_ABSOLUTE_VELOCITY;
+      } else if (strcmp(co.value, "position") == 0) {
+        config.mouse_absolute = MOUSE_ABSOLUTE_POSITION;
+      } else {
+        config.mouse_absolute = MOUSE_RELATIVE;
+      }
+    } else if (strcmp(co.key, "mouse_absolute_width") == 0) {
+      config.mouse_absolute_width = atoi(co.value) > 0 ? atoi(co.value) : 1;
+    } else if (strcmp(co.key, "mouse_absolute_height") == 0) {
+      config.mouse_absolute_height = atoi(co.value) > 0 ? atoi(co.value) : 1;
+    } else if (strcmp(co.key, "mouse_absolute_region") == 0) {
+      int* region = config.mouse_absolute_region;
+      if (sscanf(co.value, "%d,%d,%d,%d", &region[0], &region[1], &region[2], &region[3]) != 4) {
+        printf("mouse_absolute_region needs left,top,right,bottom\n");
+        region[0] = region[1] = 0;
+        region[2] = region[3] = 100;
+      }
     } 
   }
 }
 
-int applyDeadzone(int value, int deadzone)
+void setDefaultThreshold(analog_threshold& threshold, int engage, int release)
 {
-  if (std::abs(value) > deadzone) {
-    return value;
-  } else {
-    return 0;
+  if (threshold.engage < 0) threshold.engage = engage;
+  if (threshold.release < 0) threshold.release = release >= 0 ? release : threshold.engage * 3 / 4;
+  threshold.release = std::min(threshold.release, threshold.engage);
+}
+
+void setDefaultDeadzones()
+{
+  setDefaultThreshold(config.deadzone_up, config.deadzone_y, config.deadzone_y_release);
+  setDefaultThreshold(config.deadzone_down, config.deadzone_y, config.deadzone_y_release);
+  setDefaultThreshold(config.deadzone_left, config.deadzone_x, config.deadzone_x_release);
+  setDefaultThreshold(config.deadzone_right, config.deadzone_x, config.deadzone_x_release);
+  setDefaultThreshold(config.deadzone_l2, config.deadzone_triggers, config.deadzone_triggers_release);
+  setDefaultThreshold(config.deadzone_r2, config.deadzone_triggers, config.deadzone_triggers_release);
+}
+
+// Zero inside the deadzone, but a direction that is already engaged stays engaged
+// until the value drops to the (lower) release threshold, so a stick or trigger
+// resting near the deadzone edge doesn't produce bursts of press/release pairs.
+// negative and positive are the thresholds for either side of the axis
+int applyHysteresis(int axis, int value, int previous, const analog_threshold& negative, const analog_threshold& positive)
+{
+  int result = (value < -negative.engage || value > positive.engage) ? value : 0;
+  if ((previous < 0 && value < -negative.release) || (previous > 0 && value > positive.release)) {
+    result = value;
   }
+
+  // count edges a plain deadzone would have produced but the hysteresis absorbed
+  const int previous_raw = state.previous_axis_value[axis];
+  const bool previous_engaged = previous_raw < -negative.engage || previous_raw > positive.engage;
+  const bool engaged = value < -negative.engage || value > positive.engage;
+  if ((previous_engaged != engaged) && ((previous != 0) == (result != 0))) {
+    state.analog_transitions_suppressed++;
+  }
+  state.previous_axis_value[axis] = value;
+
+  return result;
 }
 
 void UINPUT_SET_ABS_P(
@@ -1169,292 +2038,2657 @@ void UINPUT_SET_ABS_P(
   dev->absflat[axis] = flat;
 }
 
-void emit(int type, int code, int val)
+Uint64 monotonicTimeUs()
 {
-  struct input_event ev;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (Uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-  ev.type = type;
-  ev.code = code;
-  ev.value = val;
-  /* timestamp values below are ignored */
-  ev.time.tv_sec = 0;
-  ev.time.tv_usec = 0;
+// the earlier of two deadlines, where 0 means no deadline
+Uint64 earliestDeadline(Uint64 a, Uint64 b)
+{
+  if (a == 0 || (b != 0 && b < a)) {
+    return b;
+  }
+  return a;
+}
+
+#define STATS_INPUT_BUTTON 0
+#define STATS_INPUT_AXIS 1
+#define STATS_INPUT_DEVICE 2
+#define STATS_INPUT_TOUCHPAD 3
+#define STATS_INPUT_SENSOR 4
+#define STATS_INPUT_OTHER 5
+#define STATS_INPUT_KINDS 6
+
+// Counters that only the main thread touches, so counting is a plain
+// increment. On SIGUSR1 the stats thread asks the main loop for a copy
+// through an SDL event, then formats and writes it out on its own time
+struct stats_counters
+{
+  unsigned long input_events[STATS_INPUT_KINDS];
+  unsigned long wakeups; // returns from waiting, for events or for timers
+  unsigned long output_events;
+  unsigned long writes;
+  unsigned long short_writes;
+  unsigned long failed_writes;
+  unsigned long mouse_ticks;
+  unsigned long repeats;
+  // filled in when the copy is taken
+  int timer_depth; // timers pending
+  Uint64 uptime_us;
+  unsigned long latency_samples;
+  Uint64 latency_total_us;
+  Uint64 latency_max_us;
+  unsigned long allocations;
+};
 
-  write(uinp_fd, &ev, sizeof(ev));
+struct
+{
+  stats_counters counters = {};
+  stats_counters snapshot;
+  Uint64 started_us = 0;
+  Uint32 event_type = 0; // SDL user event asking the main loop for a snapshot, 0 if stats are off
+  SDL_sem* ready = NULL; // posted once the snapshot is taken
+  const char* path = NULL; // set with -stats or GPTOKEYB_STATS; the log is used otherwise
+} stats;
+
+#define POWER_DEVICES_MAX 8
+#define POWER_HOTPLUG_SETTLE_US 2000000 // keep polling SDL this long after /dev/input changes
+#define POWER_HOTPLUG_POLL_US 50000
+#define POWER_RUMBLE_POLL_US 100000
+
+// SDL_WaitEvent without a video subsystem checks for events every millisecond.
+// With power_save the main loop instead sleeps in ppoll() on its own read-only
+// handles to the controllers' devices, an inotify watch on /dev/input for
+// hotplug, an eventfd that helper threads write after queueing an SDL event,
+// and a signalfd for SIGINT/SIGTERM, so it only wakes for input or a timer.
+// If a controller's device can't be opened, SDL_WaitEvent is used again
+struct
+{
+  bool enabled = false;
+  int wake_fd = -1;
+  int hotplug_fd = -1;
+  int quit_fd = -1; // SIGINT/SIGTERM, blocked on the main thread while it sleeps in ppoll()
+  sigset_t quit_signals;
+  bool quit_blocked = false;
+  Uint64 settle_until = 0; // after a hotplug, until SDL has seen the device
+  struct
+  {
+    SDL_JoystickID id;
+    int fd; // -1 if the device couldn't be opened
+  } devices[POWER_DEVICES_MAX];
+  int device_count = 0;
+  int unwatched = 0; // controllers without a device handle
+  int extra_fd = -1; // also wake when this is readable, e.g. an idle --type-file FIFO
+  bool extra_ready = false;
+} power;
+
+void wakeMainLoop()
+{
+  if (power.wake_fd >= 0) {
+    const uint64_t one = 1;
+    write(power.wake_fd, &one, sizeof(one));
+  }
 }
 
-void emitKey(int code, bool is_pressed, int modifier = 0)
+// SDL's own signal handlers only queue SDL_QUIT for its next pump, which the
+// sleeping loop wouldn't get to, so while it sleeps in ppoll() the signals are
+// blocked and read from quit_fd instead; SDL_WaitEvent gets them back
+void blockQuitSignals(bool block)
 {
-  if (!(modifier == 0) && is_pressed) {
-    emit(EV_KEY, modifier, is_pressed ? 1 : 0);
-    emit(EV_SYN, SYN_REPORT, 0);
+  if (block != power.quit_blocked) {
+    pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &power.quit_signals, NULL);
+    power.quit_blocked = block;
   }
-  emit(EV_KEY, code, is_pressed ? 1 : 0);
-  emit(EV_SYN, SYN_REPORT, 0);
-  if (!(modifier == 0) && !(is_pressed)) {
-    emit(EV_KEY, modifier, is_pressed ? 1 : 0);
-    emit(EV_SYN, SYN_REPORT, 0);
+}
+
+void startPowerSave()
+{
+  if (!config.power_save) return;
+  sigemptyset(&power.quit_signals);
+  sigaddset(&power.quit_signals, SIGINT);
+  sigaddset(&power.quit_signals, SIGTERM);
+  power.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  power.hotplug_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  power.quit_fd = signalfd(-1, &power.quit_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (power.wake_fd < 0 || power.hotplug_fd < 0 || power.quit_fd < 0
+    || inotify_add_watch(power.hotplug_fd, "/dev/input", IN_CREATE | IN_DELETE | IN_ATTRIB) < 0) {
+    printf("power saving not available: %s\n", strerror(errno));
+    if (power.wake_fd >= 0) close(power.wake_fd);
+    if (power.hotplug_fd >= 0) close(power.hotplug_fd);
+    if (power.quit_fd >= 0) close(power.quit_fd);
+    power.wake_fd = power.hotplug_fd = power.quit_fd = -1;
+    return;
   }
+  power.enabled = true;
 }
 
-void emitTextInputKey(int code, bool uppercase)
+void watchController(SDL_GameController* controller)
 {
-  if (uppercase) { //capitalise capital letters by holding shift
-    emitKey(KEY_LEFTSHIFT, true);
+  if (!power.enabled || controller == NULL) return;
+  SDL_Joystick* joystick = SDL_GameControllerGetJoystick(controller);
+  const SDL_JoystickID id = SDL_JoystickInstanceID(joystick);
+  for (int i = 0; i < power.device_count; i++) {
+    if (power.devices[i].id == id) return;
   }
-  emitKey(code, true);
-  SDL_Delay(16);
-  emitKey(code, false);
-  SDL_Delay(16);
-  if (uppercase) { //release shift if held
-    emitKey(KEY_LEFTSHIFT, false);
+  int fd = -1;
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+  if (const char* path = SDL_JoystickPath(joystick)) {
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
   }
+#endif
+  if (power.device_count == POWER_DEVICES_MAX) {
+    if (fd >= 0) close(fd);
+    power.unwatched++; // not tracked by id, so the fallback stays on from here
+    return;
+  }
+  if (fd < 0) {
+    logMessage(LOG_INFO, "can't watch controller %d directly, power saving is off while it is connected\n", id);
+    power.unwatched++;
+  }
+  power.devices[power.device_count].id = id;
+  power.devices[power.device_count].fd = fd;
+  power.device_count++;
 }
 
-void addTextInputCharacter()
+void unwatchController(SDL_JoystickID id)
 {
-  emitTextInputKey(character_set[current_key[current_character]],character_set_shift[current_key[current_character]]);
+  for (int i = 0; i < power.device_count; i++) {
+    if (power.devices[i].id == id) {
+      if (power.devices[i].fd >= 0) {
+        close(power.devices[i].fd);
+      } else {
+        power.unwatched--;
+      }
+      power.devices[i] = power.devices[--power.device_count];
+      return;
+    }
+  }
 }
 
-void removeTextInputCharacter()
+// Whether waitForEvent sleeps in ppoll(), and so also wakes for extra_fd
+bool powerSleepsInPoll()
 {
-  emitTextInputKey(KEY_BACKSPACE,false); //delete one character
+  return power.enabled && power.unwatched == 0;
 }
 
-void confirmTextInputCharacter()
+// Wait for the next SDL event until deadline, 0 for no deadline.
+// Returns 1 with an event, 0 once the deadline passes and -1 on error
+int waitForEvent(SDL_Event* event, Uint64 deadline)
 {
-  emitTextInputKey(KEY_ENTER,false); //emit ENTER to confirm text input
+  if (!powerSleepsInPoll()) {
+    if (power.enabled) {
+      blockQuitSignals(false); // SDL's handlers take them again
+    }
+    if (deadline == 0) {
+      return SDL_WaitEvent(event) ? 1 : -1;
+    }
+    const Uint64 now = monotonicTimeUs();
+    // round down; once less than 1 ms remains this polls, which keeps timers within 1 ms
+    return SDL_WaitEventTimeout(event, deadline > now ? (deadline - now) / 1000 : 0);
+  }
+
+  blockQuitSignals(true);
+  while (true) {
+    if (SDL_PollEvent(event)) {
+      return 1;
+    }
+    const Uint64 now = monotonicTimeUs();
+    if (deadline != 0 && deadline <= now) {
+      return 0;
+    }
+    Uint64 wake = deadline;
+    if (power.settle_until > now) {
+      wake = earliestDeadline(wake, now + POWER_HOTPLUG_POLL_US);
+    }
+
+    struct pollfd fds[POWER_DEVICES_MAX + 4];
+    int count = 0;
+    fds[count++] = {power.wake_fd, POLLIN, 0};
+    fds[count++] = {power.hotplug_fd, POLLIN, 0};
+    for (int i = 0; i < power.device_count; i++) {
+      fds[count++] = {power.devices[i].fd, POLLIN, 0};
+    }
+    const int devices_end = count;
+    fds[count++] = {power.quit_fd, POLLIN, 0};
+    if (power.extra_fd >= 0) {
+      fds[count++] = {power.extra_fd, POLLIN, 0};
+    }
+    struct timespec timeout;
+    timeout.tv_sec = (wake - now) / 1000000;
+    timeout.tv_nsec = (wake - now) % 1000000 * 1000;
+    if (ppoll(fds, count, wake != 0 ? &timeout : NULL, NULL) < 0) {
+      if (errno == EINTR) continue;
+      logMessage(LOG_ERROR, "ppoll() failed: %s\n", strerror(errno));
+      return -1;
+    }
+
+    // our copies of the events are only a wakeup; SDL reads its own
+    struct input_event discard[64];
+    for (int i = 0; i < devices_end; i++) {
+      if (fds[i].revents & POLLIN) {
+        while (read(fds[i].fd, discard, sizeof(discard)) > 0) {}
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      power.settle_until = monotonicTimeUs() + POWER_HOTPLUG_SETTLE_US;
+    }
+    // a controller that went away; SDL reports the removal on a later pump
+    for (int i = devices_end - 1; i >= 2; i--) {
+      if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        close(power.devices[i - 2].fd);
+        power.devices[i - 2] = power.devices[--power.device_count];
+        power.settle_until = monotonicTimeUs() + POWER_HOTPLUG_SETTLE_US;
+      }
+    }
+    if (fds[devices_end].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(power.quit_fd, &info, sizeof(info)) > 0) {}
+      SDL_Event quit;
+      memset(&quit, 0, sizeof(quit));
+      quit.type = SDL_QUIT;
+      SDL_PushEvent(&quit);
+    }
+    // the owner of the extra handle reads it, from the main loop
+    if (devices_end + 1 < count && (fds[devices_end + 1].revents & POLLIN)) {
+      power.extra_ready = true;
+      return 0;
+    }
+  }
 }
 
-void nextTextInputKey(bool SingleIncrease) // enable fast skipping if SingleIncrease = false
+void writeEvents(int fd, const void* events, size_t bytes)
 {
-  removeTextInputCharacter(); //delete character(s)
-  if (SingleIncrease) {
-    current_key[current_character]++;
-  } else {
-    current_key[current_character] = current_key[current_character] + 13; // jump forward by half alphabet
-  }
-  if (current_key[current_character] >= maxKeys) {
-     current_key[current_character] = current_key[current_character] - maxKeys;
-  } else if ((current_character == 0) && (character_set[current_key[current_character]] == KEY_SPACE)) {
-      current_key[current_character]++; //skip space as first character 
+  stats.counters.writes++;
+  const ssize_t written = write(fd, events, bytes);
+  if (written < 0) {
+    stats.counters.failed_writes++;
+  } else if ((size_t)written != bytes) {
+    stats.counters.short_writes++;
   }
+}
 
-  addTextInputCharacter(); //add new character
+#define RECORDER_MAGIC 0x52545047 // "GPTR"
+#define RECORDER_VERSION 1
+#define RECORDER_RECORDS 4096 // must be a power of two
+
+#define RECORD_INPUT 1 // SDL event: type, which, button or axis, value (touchpad: finger, x, y)
+#define RECORD_KEY 2 // mapped key: code, pressed, modifier flags in which
+#define RECORD_OUTPUT 3 // input_event queued for uinput: type, code, value
+#define RECORD_NOTE 4 // code is one of the RECORDER_NOTE_* values
+
+#define RECORDER_NOTE_START 1
+#define RECORDER_NOTE_RELEASE_ALL 2
+#define RECORDER_NOTE_EXIT 3
+
+// Flight recorder: the most recent input events, mapped keys and output
+// events, kept in a ring in a shared file mapping. The pages belong to the
+// file, so what was written survives a crash and --dump-recorder can decode it
+struct recorder_record
+{
+  Uint64 time_us; // CLOCK_MONOTONIC
+  Uint64 number; // record number + 1, stored last; a mismatch marks a torn or overwritten slot
+  Uint32 type;
+  Uint16 code;
+  Uint8 kind; // RECORD_*
+  Uint8 padding;
+  Sint32 value;
+  Sint32 which;
+};
+
+struct recorder_header
+{
+  Uint32 magic;
+  Uint32 version;
+  Uint32 record_size;
+  Uint32 capacity;
+  Uint64 next; // number of the next record to be written
+  Uint8 padding[40]; // records start on a cache line
+};
+
+struct
+{
+  const char* path = NULL; // set with -recorder or GPTOKEYB_RECORDER
+  recorder_header* header = NULL;
+  recorder_record* records = NULL;
+  Uint64 next = 0;
+} recorder;
+
+void record(Uint8 kind, Uint32 type, int code, int value, int which = 0)
+{
+  if (recorder.header == NULL) {
+    return;
+  }
+  const Uint64 number = recorder.next++;
+  recorder_record& r = recorder.records[number & (RECORDER_RECORDS - 1)];
+  // mark the slot invalid before rewriting it, so a record cut short by a
+  // crash never shows the number of the record it is replacing
+  __atomic_store_n(&r.number, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  r.time_us = monotonicTimeUs();
+  r.type = type;
+  r.code = code;
+  r.kind = kind;
+  r.value = value;
+  r.which = which;
+  __atomic_store_n(&r.number, number + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&recorder.header->next, number + 1, __ATOMIC_RELAXED);
 }
 
-void prevTextInputKey(bool SingleDecrease)
+void openRecorder()
 {
-  removeTextInputCharacter(); //delete character(s)
-  if (SingleDecrease) {
-    current_key[current_character]--;
-  } else {
-    current_key[current_character] = current_key[current_character] - 13; // jump back by half alphabet  
+  const size_t size = sizeof(recorder_header) + RECORDER_RECORDS * sizeof(recorder_record);
+  int fd = open(recorder.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    printf("Unable to create recorder file %s\n", recorder.path);
+    if (fd >= 0) close(fd);
+    return;
   }
-  if (current_key[current_character] < 0) {
-     current_key[current_character] = current_key[current_character] + maxKeys;
-  } else if ((current_character == 0) && (character_set[current_key[current_character]] == KEY_SPACE)) {
-      current_key[current_character]--; //skip space as first character due to weird graphical issue with Exult
+  void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    printf("Unable to map recorder file %s\n", recorder.path);
+    return;
   }
-  addTextInputCharacter(); //add new character
+  recorder.header = (recorder_header*)mapped;
+  recorder.header->magic = RECORDER_MAGIC;
+  recorder.header->version = RECORDER_VERSION;
+  recorder.header->record_size = sizeof(recorder_record);
+  recorder.header->capacity = RECORDER_RECORDS;
+  recorder.records = (recorder_record*)((char*)mapped + sizeof(recorder_header));
+  printf("Recording recent input in %s\n", recorder.path);
+  record(RECORD_NOTE, 0, RECORDER_NOTE_START, getpid());
 }
 
-Uint32 repeatInputCallback(Uint32 interval, void *param)
+void recordInput(const SDL_Event& event)
 {
-    int key_code = *reinterpret_cast<int*>(param); 
-    if (key_code == KEY_UP) {
-      prevTextInputKey(true);
-      interval = config.key_repeat_interval; // key repeats according to repeat interval
-    } else if (key_code == KEY_DOWN) {
-      nextTextInputKey(true);
-      interval = config.key_repeat_interval; // key repeats according to repeat interval
-    } else {
-      interval = 0; //turn off timer if invalid keycode
-    }
-    return(interval);
+  switch (event.type) {
+    case SDL_CONTROLLERBUTTONDOWN:
+    case SDL_CONTROLLERBUTTONUP:
+      record(RECORD_INPUT, event.type, event.cbutton.button, event.cbutton.state, event.cbutton.which);
+      break;
+    case SDL_CONTROLLERAXISMOTION:
+      record(RECORD_INPUT, event.type, event.caxis.axis, event.caxis.value, event.caxis.which);
+      break;
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+    case SDL_CONTROLLERTOUCHPADDOWN:
+    case SDL_CONTROLLERTOUCHPADMOTION:
+    case SDL_CONTROLLERTOUCHPADUP:
+      // position in 1/10000 of the touchpad, x in value and y in which
+      record(RECORD_INPUT, event.type, event.ctouchpad.finger, (int)(event.ctouchpad.x * 10000), (int)(event.ctouchpad.y * 10000));
+      break;
+    case SDL_CONTROLLERSENSORUPDATE:
+      break; // hundreds per second, they would push everything else out of the ring
+#endif
+    default:
+      record(RECORD_INPUT, event.type, 0, 0, event.cdevice.which);
+      break;
+  }
 }
-void setInputRepeat(int code, bool is_pressed)
+
+const char* sdlEventName(Uint32 type)
 {
-  if (is_pressed) {
-    state.key_to_repeat = code;
-    state.key_repeat_timer_id=SDL_AddTimer(config.key_repeat_interval, repeatInputCallback, &state.key_to_repeat); // for a new repeat, use repeat delay for first time, then switch to repeat interval
-  } else {
-    SDL_RemoveTimer( state.key_repeat_timer_id );
-    state.key_repeat_timer_id=0;
-    state.key_to_repeat=0;
+  switch (type) {
+    case SDL_QUIT: return "quit";
+    case SDL_CONTROLLERAXISMOTION: return "axis";
+    case SDL_CONTROLLERBUTTONDOWN: return "button_down";
+    case SDL_CONTROLLERBUTTONUP: return "button_up";
+    case SDL_CONTROLLERDEVICEADDED: return "device_added";
+    case SDL_CONTROLLERDEVICEREMOVED: return "device_removed";
+    case SDL_CONTROLLERDEVICEREMAPPED: return "device_remapped";
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+    case SDL_CONTROLLERTOUCHPADDOWN: return "touch_down";
+    case SDL_CONTROLLERTOUCHPADMOTION: return "touch_motion";
+    case SDL_CONTROLLERTOUCHPADUP: return "touch_up";
+#endif
   }
+  return "event";
 }
 
-
-void processKeys()
+// --dump-recorder <file>: print the recorded history, oldest first
+int dumpRecorder(const char* path)
 {
-  int lenText = strlen(config.text_input_preset);
-  char str[2];
-  char lowerstr[2];
-  char upperstr[2];
-  char lowerchar;
-  char upperchar;
-  bool uppercase = false;
-  for (int ii = 0; ii < lenText; ii++) {  
-    if (config.text_input_preset[ii] != '\0') {
-        memcpy( str, &config.text_input_preset[ii], 1 );        
-        str[1] = '\0';
-
-        lowerchar = std::tolower(config.text_input_preset[ii], std::locale());
-        upperchar = std::toupper(config.text_input_preset[ii], std::locale());
-
-        memcpy( upperstr, &upperchar, 1 );        
-        upperstr[1] = '\0';
-        memcpy( lowerstr, &lowerchar, 1 );        
-        lowerstr[1] = '\0';
-        uppercase = (strcmp(upperstr,str) == 0);
-
-        int code = char_to_keycode(lowerstr);
-
-        if (strcmp(str, " ") == 0) {
-            code = KEY_SPACE;
-            uppercase = false;
-        } else if (strcmp(str, "_") == 0) {
-            code = KEY_MINUS;
-            uppercase = true;
-        } else if (strcmp(str, "-") == 0) {
-            code = KEY_MINUS;
-            uppercase = true;
-        } else if (strcmp(str, ".") == 0) {
-            code = KEY_DOT;
-            uppercase = false;
-        } else if (strcmp(str, ",") == 0) {
-            code = KEY_COMMA;
-            uppercase = false;
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    printf("Unable to open recorder file %s\n", path);
+    return -1;
+  }
+  recorder_header header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != RECORDER_MAGIC
+    || header.version != RECORDER_VERSION || header.record_size != sizeof(recorder_record)
+    || header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0) {
+    printf("%s is not a recorder file of this version\n", path);
+    fclose(fp);
+    return -1;
+  }
+  std::vector<recorder_record> records(header.capacity);
+  if (fread(records.data(), sizeof(recorder_record), header.capacity, fp) != header.capacity) {
+    printf("%s is truncated\n", path);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  static const char* const notes[] = {"", "start", "release_all", "exit"};
+  const Uint64 first = header.next > header.capacity ? header.next - header.capacity : 0;
+  Uint64 start_us = 0;
+  for (Uint64 number = first; number < header.next; number++) {
+    const recorder_record& r = records[number & (header.capacity - 1)];
+    if (r.number != number + 1) {
+      continue; // being rewritten when the recorder stopped
+    }
+    if (start_us == 0) {
+      start_us = r.time_us;
+    }
+    printf("%10.3f ms  ", (r.time_us - start_us) / 1000.0);
+    switch (r.kind) {
+      case RECORD_INPUT:
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+        if (r.type == SDL_CONTROLLERTOUCHPADDOWN || r.type == SDL_CONTROLLERTOUCHPADMOTION || r.type == SDL_CONTROLLERTOUCHPADUP) {
+          printf("in   %-15s finger=%d x=%.4f y=%.4f\n", sdlEventName(r.type), r.code, r.value / 10000.0, r.which / 10000.0);
+          break;
         }
-        
-        emitTextInputKey(code, uppercase);
-    } // if valid character
-  } //for
+#endif
+        printf("in   %-15s which=%d code=%d value=%d\n", sdlEventName(r.type), r.which, r.code, r.value);
+        break;
+      case RECORD_KEY:
+        printf("key  %-15s code=%d modifiers=%d\n", r.value ? "press" : "release", r.code, r.which);
+        break;
+      case RECORD_OUTPUT:
+        printf("out  type=%d code=%d value=%d\n", r.type, r.code, r.value);
+        break;
+      case RECORD_NOTE:
+        printf("note %s %d\n", r.code < sizeof(notes) / sizeof(notes[0]) ? notes[r.code] : "?", r.value);
+        break;
+    }
+  }
+  printf("%llu records written, last %u kept\n", (unsigned long long)header.next, header.capacity);
+  return 0;
 }
 
-Uint32 repeatKeyCallback(Uint32 interval, void *param)
+void emit(int type, int code, int val)
 {
-    //timerCallback requires pointer parameter, but passing pointer to key_code for analog sticks doesn't work
-    int key_code = *reinterpret_cast<int*>(param); 
-    emitKey(key_code, false);
-    emitKey(key_code, true); 
-    interval = config.key_repeat_interval; // key repeats according to repeat interval; initial interval is set to delay
-    return(interval);
+  record(RECORD_OUTPUT, type, code, val);
+  stats.counters.output_events++;
+  if (output.count == OUTPUT_QUEUE_MAX) {
+    writeEvents(uinp_fd, output.events, output.count * sizeof(struct input_event));
+    output.count = 0;
+  }
+
+  struct input_event& ev = output.events[output.count++];
+
+  ev.type = type;
+  ev.code = code;
+  ev.value = val;
+  /* timestamp values below are ignored */
+  ev.time.tv_sec = 0;
+  ev.time.tv_usec = 0;
 }
-void setKeyRepeat(int code, bool is_pressed)
+
+void queueWheel(int hi_res_code, int code, int& units, int& notch)
 {
-  if (is_pressed) {
-    state.key_to_repeat=code;
-    state.key_repeat_timer_id=SDL_AddTimer(config.key_repeat_delay, repeatKeyCallback, &state.key_to_repeat); // for a new repeat, use repeat delay for first time, then switch to repeat interval
-  } else {
-    SDL_RemoveTimer( state.key_repeat_timer_id );
-    state.key_repeat_timer_id=0;
-    state.key_to_repeat=0;
+  if (units == 0) {
+    return;
   }
+  emit(EV_REL, hi_res_code, units);
+  // readers without hi-res support get the plain event for every whole notch
+  if ((units < 0) != (notch < 0)) {
+    notch = 0;
+  }
+  notch += units;
+  if (notch / MOUSE_WHEEL_NOTCH != 0) {
+    emit(EV_REL, code, notch / MOUSE_WHEEL_NOTCH);
+    notch %= MOUSE_WHEEL_NOTCH;
+  }
+  units = 0;
 }
-void emitAxisMotion(int code, int value)
+
+// Queue all axis and relative motion accumulated during the current controller
+// frame as a single report, so e.g. a diagonal stick move reaches the game as
+// one X+Y update instead of two separate frames.
+void queueMotion()
 {
-  emit(EV_ABS, code, value);
+  if (output.abs_pending_count == 0 && output.rel_x == 0 && output.rel_y == 0 && output.wheel == 0 && output.hwheel == 0) {
+    return;
+  }
+
+  for (int i = 0; i < output.abs_pending_count; i++) {
+    const int code = output.abs_pending[i];
+    emit(EV_ABS, code, output.abs_value[code]);
+    output.abs_is_pending[code] = false;
+  }
+  output.abs_pending_count = 0;
+
+  if (output.rel_x != 0) {
+    emit(EV_REL, REL_X, output.rel_x);
+  }
+  if (output.rel_y != 0) {
+    emit(EV_REL, REL_Y, output.rel_y);
+  }
+  output.rel_x = 0;
+  output.rel_y = 0;
+
+  queueWheel(REL_WHEEL_HI_RES, REL_WHEEL, output.wheel, output.wheel_notch);
+  queueWheel(REL_HWHEEL_HI_RES, REL_HWHEEL, output.hwheel, output.hwheel_notch);
+
   emit(EV_SYN, SYN_REPORT, 0);
 }
 
-void emitMouseMotion(int x, int y)
+void flushPointer()
 {
-  if (x != 0) {
-    emit(EV_REL, REL_X, x);
-  }
-  if (y != 0) {
-    emit(EV_REL, REL_Y, y);
+  if (!pointer.moved && !pointer.touch_changed) {
+    return;
   }
 
-  if (x != 0 || y != 0) {
-    emit(EV_SYN, SYN_REPORT, 0);
+  struct input_event events[4];
+  int count = 0;
+  memset(events, 0, sizeof(events));
+  if (pointer.moved) {
+    events[count].type = EV_ABS;
+    events[count].code = ABS_X;
+    events[count++].value = pointer.x;
+    events[count].type = EV_ABS;
+    events[count].code = ABS_Y;
+    events[count++].value = pointer.y;
+  }
+  if (pointer.touch_changed) {
+    events[count].type = EV_KEY;
+    events[count].code = BTN_TOUCH;
+    events[count++].value = pointer.touch;
   }
+  events[count].type = EV_SYN;
+  events[count++].code = SYN_REPORT;
+  stats.counters.output_events += count;
+  writeEvents(pointer.fd, events, count * sizeof(struct input_event));
+
+  pointer.moved = false;
+  pointer.touch_changed = false;
 }
 
-void handleAnalogTrigger(bool is_triggered, bool& was_triggered, int key, int modifier=0)
+void movePointer(int x, int y)
 {
-  if (is_triggered && !was_triggered) {
-    emitKey(key, true, modifier);
-  } else if (!is_triggered && was_triggered) {
-    emitKey(key, false, modifier);
+  if (x < 0) x = 0;
+  if (x >= config.mouse_absolute_width) x = config.mouse_absolute_width - 1;
+  if (y < 0) y = 0;
+  if (y >= config.mouse_absolute_height) y = config.mouse_absolute_height - 1;
+  if (x != pointer.x || y != pointer.y) {
+    pointer.x = x;
+    pointer.y = y;
+    pointer.moved = true;
   }
+}
 
-  was_triggered = is_triggered;
+void setPointerTouch(bool touch)
+{
+  // a click that starts and ends within one batch still needs two reports
+  if (pointer.touch_changed && touch != pointer.touch) {
+    flushPointer();
+  }
+  if (touch != pointer.touch) {
+    pointer.touch = touch;
+    pointer.touch_changed = true;
+  }
 }
 
-void setupFakeKeyboardMouseDevice(uinput_user_dev& device, int fd)
+// Hand everything queued so far to uinput with a single write()
+void flushEvents()
 {
-  strncpy(device.name, "Fake Keyboard", UINPUT_MAX_NAME_SIZE);
-  device.id.vendor = 0x1234;  /* sample vendor */
-  device.id.product = 0x5678; /* sample product */
+  queueMotion();
+  if (pointer.fd >= 0) {
+    flushPointer();
+  }
 
-  for (int i = 0; i < 256; i++) {
-    ioctl(fd, UI_SET_KEYBIT, i);
+  if (output.count > 0) {
+    writeEvents(uinp_fd, output.events, output.count * sizeof(struct input_event));
+    output.count = 0;
   }
+}
 
-  // Keys or Buttons
-  ioctl(fd, UI_SET_EVBIT, EV_KEY);
-  ioctl(fd, UI_SET_EVBIT, EV_SYN);
+// Queued events must reach the game before we pause between key press and release
+void flushAndDelay(Uint32 ms)
+{
+  flushEvents();
+  SDL_Delay(ms);
+}
 
-  // Fake mouse
-  ioctl(fd, UI_SET_EVBIT, EV_REL);
-  ioctl(fd, UI_SET_RELBIT, REL_X);
-  ioctl(fd, UI_SET_RELBIT, REL_Y);
+// With the touchscreen pointer the left mouse button touches the screen at the pointer instead
+void emitKeyEvent(int code, int value)
+{
+  if (code == BTN_LEFT && pointer.fd >= 0) {
+    setPointerTouch(value != 0);
+  } else {
+    emit(EV_KEY, code, value);
+  }
+}
+
+bool isKeyPressed(int code)
+{
+  return key_state.pressed[code / KEY_STATE_BITS] & (1UL << (code % KEY_STATE_BITS));
+}
+
+// returns true if the key changed state on the virtual device
+bool pressKey(int code)
+{
+  if (key_state.refcount[code] < 255) {
+    key_state.refcount[code]++;
+  }
+  if (isKeyPressed(code)) {
+    return false;
+  }
+  key_state.pressed[code / KEY_STATE_BITS] |= 1UL << (code % KEY_STATE_BITS);
+  emitKeyEvent(code, 1);
+  return true;
+}
+
+bool releaseKey(int code)
+{
+  if (key_state.refcount[code] > 0) {
+    key_state.refcount[code]--;
+  }
+  if (key_state.refcount[code] > 0 || !isKeyPressed(code)) {
+    return false;
+  }
+  key_state.pressed[code / KEY_STATE_BITS] &= ~(1UL << (code % KEY_STATE_BITS));
+  emitKeyEvent(code, 0);
+  return true;
+}
+
+bool isWheelCode(int code)
+{
+  return code >= MOUSE_WHEEL_UP && code <= MOUSE_WHEEL_RIGHT;
+}
+
+// One notch per press of a mouse_wheel_* mapping, reported straight away so it
+// stays in order with the modifiers around it
+void emitWheelNotch(int code)
+{
+  output.wheel += code == MOUSE_WHEEL_UP ? MOUSE_WHEEL_NOTCH : (code == MOUSE_WHEEL_DOWN ? -MOUSE_WHEEL_NOTCH : 0);
+  output.hwheel += code == MOUSE_WHEEL_RIGHT ? MOUSE_WHEEL_NOTCH : (code == MOUSE_WHEEL_LEFT ? -MOUSE_WHEEL_NOTCH : 0);
+  queueMotion();
+}
+
+// Modifiers are pressed in a fixed order before the key and released in reverse
+// after it, all in one report; only real state transitions are emitted
+void emitKey(int code, bool is_pressed, int modifier = 0)
+{
+  record(RECORD_KEY, 0, code, is_pressed, modifier);
+  static const struct
+  {
+    int flag;
+    int code;
+  } modifier_keys[] = {
+    {MODIFIER_CTRL, KEY_LEFTCTRL},
+    {MODIFIER_ALT, KEY_LEFTALT},
+    {MODIFIER_SHIFT, KEY_LEFTSHIFT},
+  };
+  const int modifier_count = sizeof(modifier_keys) / sizeof(modifier_keys[0]);
+  bool changed = false;
+
+  if (is_pressed) {
+    for (int i = 0; i < modifier_count; i++) {
+      if (modifier & modifier_keys[i].flag) changed |= pressKey(modifier_keys[i].code);
+    }
+    if (isWheelCode(code)) {
+      if (changed) emit(EV_SYN, SYN_REPORT, 0);
+      changed = false;
+      emitWheelNotch(code);
+    } else {
+      changed |= pressKey(code);
+    }
+  } else {
+    if (!isWheelCode(code)) changed |= releaseKey(code);
+    for (int i = modifier_count - 1; i >= 0; i--) {
+      if (modifier & modifier_keys[i].flag) changed |= releaseKey(modifier_keys[i].code);
+    }
+  }
+
+  if (changed) {
+    emit(EV_SYN, SYN_REPORT, 0);
+  }
+}
+
+// Key repeat toggles the key on the device without touching its reference count
+void emitKeyRepeat(int code)
+{
+  if (isWheelCode(code)) {
+    emitWheelNotch(code);
+    return;
+  }
+  if (!isKeyPressed(code)) {
+    return;
+  }
+  emitKeyEvent(code, 0);
+  emit(EV_SYN, SYN_REPORT, 0);
+  emitKeyEvent(code, 1);
+  emit(EV_SYN, SYN_REPORT, 0);
+}
+
+void startMacro(int number)
+{
+  if (macros.length[number] == 0) {
+    return;
+  }
+
+  macro_run* free_run = NULL;
+  for (auto& run : running_macros) {
+    if (run.macro == number) {
+      return; // still running from the previous press
+    } else if (run.macro == 0 && free_run == NULL) {
+      free_run = &run;
+    }
+  }
+
+  if (free_run != NULL) {
+    free_run->macro = number;
+    free_run->step = 0;
+    free_run->resume_at = monotonicTimeUs();
+  }
+}
+
+// Advance every running macro as far as it can go without waiting; each macro
+// picks up where it left off once its delay has passed, so macros never block
+// controller input or each other
+void runMacros(Uint64 now)
+{
+  for (auto& run : running_macros) {
+    while (run.macro != 0 && run.resume_at <= now) {
+      if (run.step == macros.length[run.macro]) {
+        run.macro = 0;
+        break;
+      }
+
+      const macro_step& step = macros.steps[macros.start[run.macro] + run.step++];
+      if (step.action == MACRO_DELAY) {
+        run.resume_at = now + step.value * 1000;
+      } else {
+        emitKey(step.value, step.action == MACRO_PRESS);
+      }
+    }
+  }
+}
+
+// earliest time a running macro needs to resume, or 0 if none is running
+Uint64 nextMacroDeadline()
+{
+  Uint64 deadline = 0;
+  for (const auto& run : running_macros) {
+    if (run.macro != 0 && (deadline == 0 || run.resume_at < deadline)) {
+      deadline = run.resume_at;
+    }
+  }
+  return deadline;
+}
+
+void stopMacros()
+{
+  for (auto& run : running_macros) {
+    run.macro = 0;
+  }
+}
+
+// A dual-role button sends its normal key when tapped (released within
+// hold_delay) and its _hold key once held longer. Nothing is sent while the
+// press is undecided; the hold key goes out exactly when hold_delay expires,
+// via the main loop's deadline rather than a blocking delay.
+void handleDualRole(int button, bool is_pressed)
+{
+  dual_role& role = dual_roles[button];
+  const button_mapping* m = buttonMapping(button);
+  const Uint64 now = monotonicTimeUs();
+
+  if (is_pressed) {
+    if (role.state == DUAL_ROLE_TAP) { // tapped again before the previous tap was released
+      emitKey(*m->key, false, *m->modifier);
+    }
+    role.state = DUAL_ROLE_PENDING;
+    role.deadline = now + config.hold_delay * 1000;
+  } else if (role.state == DUAL_ROLE_PENDING) {
+    emitKey(*m->key, true, *m->modifier);
+    role.state = DUAL_ROLE_TAP;
+    role.deadline = now + MACRO_TAP_DELAY * 1000;
+  } else if (role.state == DUAL_ROLE_HOLD) {
+    emitKey(config.button_hold[button], false, config.button_hold_modifier[button]);
+    role.state = DUAL_ROLE_IDLE;
+  }
+}
+
+void runDualRoles(Uint64 now)
+{
+  for (int button = 0; button < SDL_CONTROLLER_BUTTON_MAX; button++) {
+    dual_role& role = dual_roles[button];
+    if (role.state == DUAL_ROLE_PENDING && role.deadline <= now) {
+      emitKey(config.button_hold[button], true, config.button_hold_modifier[button]);
+      role.state = DUAL_ROLE_HOLD;
+    } else if (role.state == DUAL_ROLE_TAP && role.deadline <= now) {
+      const button_mapping* m = buttonMapping(button);
+      emitKey(*m->key, false, *m->modifier);
+      role.state = DUAL_ROLE_IDLE;
+    }
+  }
+}
+
+Uint64 nextDualRoleDeadline()
+{
+  Uint64 deadline = 0;
+  for (const auto& role : dual_roles) {
+    if ((role.state == DUAL_ROLE_PENDING || role.state == DUAL_ROLE_TAP) && (deadline == 0 || role.deadline < deadline)) {
+      deadline = role.deadline;
+    }
+  }
+  return deadline;
+}
+
+// Buttons used in a layer chord only activate layers while held; if no layer
+// key was sent by the time they are released, they send the key of tap_button
+// (normally themselves) as a tap. Other buttons, and the triggers as LAYER_L2
+// and LAYER_R2, send their key from the active layer if it maps them, and
+// release exactly what they pressed even if the layer changed meanwhile.
+// Returns false if the button isn't handled by layers.
+bool handleLayerButton(int button, bool is_pressed, int tap_button)
+{
+  if (button < 0 || button >= LAYER_KEYS) {
+    return false;
+  }
+
+  const unsigned int chord_bit = button < SDL_CONTROLLER_BUTTON_MAX ? layers.chord_bit[button] : 0;
+  if (chord_bit != 0) {
+    if (is_pressed) {
+      if (layers.held == 0) {
+        layers.layer_used = false;
+      }
+      layers.held |= chord_bit;
+    } else {
+      layers.held &= ~chord_bit;
+      if (!layers.layer_used) {
+        const button_mapping* m = buttonMapping(tap_button);
+        emitKey(*m->key, true, *m->modifier);
+        dual_roles[tap_button].state = DUAL_ROLE_TAP; // released from the main loop like a dual-role tap
+        dual_roles[tap_button].deadline = monotonicTimeUs() + MACRO_TAP_DELAY * 1000;
+      }
+    }
+    return true;
+  }
+
+  if (!is_pressed) {
+    if (layers.pressed_key[button] == 0) {
+      return false;
+    }
+    emitKey(layers.pressed_key[button], false, layers.pressed_modifier[button]);
+    layers.pressed_key[button] = 0;
+    return true;
+  }
+
+  const int layer = layers.active_layer[layers.held];
+  if (layer == 0 || config.layer_key[layer][button] == 0) {
+    return false;
+  }
+  layers.pressed_key[button] = config.layer_key[layer][button];
+  layers.pressed_modifier[button] = config.layer_modifier[layer][button];
+  layers.layer_used = true;
+  emitKey(layers.pressed_key[button], true, layers.pressed_modifier[button]);
+  return true;
+}
+
+// All turbo buttons share one epoch, so buttons with the same rate press and
+// release in phase; while a turbo button is held its key follows the shared
+// cycle, driven by the main loop's timer wait
+struct
+{
+  Uint64 epoch = 0;
+  bool held[SDL_CONTROLLER_BUTTON_MAX] = {};
+  bool key_down[SDL_CONTROLLER_BUTTON_MAX] = {};
+  Uint64 next_edge[SDL_CONTROLLER_BUTTON_MAX] = {}; // when the turbo key is next due to change
+  Uint64 max_lateness_us = 0; // worst delay between a scheduled and an emitted turbo edge
+} turbo;
+
+// whether the turbo key should be down at now, and when that next changes
+bool turboPhase(int button, Uint64 now, Uint64& next_edge)
+{
+  const Uint64 period = 1000000 / config.button_turbo[button];
+  const int duty = config.button_turbo_duty[button] != 0 ? config.button_turbo_duty[button] : config.turbo_duty;
+  const Uint64 down_time = period * duty / 100;
+  const Uint64 cycle_start = now - (now - turbo.epoch) % period;
+
+  if (now - cycle_start < down_time) {
+    next_edge = cycle_start + down_time;
+    return true;
+  }
+  next_edge = cycle_start + period;
+  return false;
+}
+
+void runTurbo(Uint64 now)
+{
+  for (int button = 0; button < SDL_CONTROLLER_BUTTON_MAX; button++) {
+    if (!turbo.held[button] && !turbo.key_down[button]) {
+      continue;
+    }
+
+    Uint64 next_edge = 0;
+    const bool down = turbo.held[button] && turboPhase(button, now, next_edge);
+    if (down != turbo.key_down[button]) {
+      const button_mapping* m = buttonMapping(button);
+      emitKey(*m->key, down, *m->modifier);
+      turbo.key_down[button] = down;
+      if (turbo.next_edge[button] != 0 && now > turbo.next_edge[button] &&
+          now - turbo.next_edge[button] > turbo.max_lateness_us) {
+        turbo.max_lateness_us = now - turbo.next_edge[button];
+      }
+    }
+    turbo.next_edge[button] = next_edge;
+  }
+}
+
+void handleTurbo(int button, bool is_pressed)
+{
+  const Uint64 now = monotonicTimeUs();
+  if (turbo.epoch == 0) {
+    turbo.epoch = now;
+  }
+  turbo.held[button] = is_pressed;
+  turbo.next_edge[button] = 0; // the button itself changed, so this edge isn't a scheduled one
+  runTurbo(now); // press right away if the shared cycle is in its down phase
+}
+
+Uint64 nextTurboDeadline()
+{
+  Uint64 deadline = 0;
+  for (int button = 0; button < SDL_CONTROLLER_BUTTON_MAX; button++) {
+    if (turbo.held[button]) {
+      deadline = earliestDeadline(deadline, turbo.next_edge[button]);
+    }
+  }
+  return deadline;
+}
+
+void stopKeyRepeat()
+{
+  state.key_repeat_at = 0;
+  state.key_to_repeat = 0;
+}
+
+// Release everything the virtual device still reports as held (keys, mouse and
+// pad buttons, deflected pad axes) in a single batched write. Used whenever the
+// button releases that would normally do this may never arrive: controller
+// removal, switching input modes mid-press and shutdown.
+void releaseAllKeys()
+{
+  record(RECORD_NOTE, 0, RECORDER_NOTE_RELEASE_ALL, 0);
+  stopKeyRepeat();
+  stopMacros();
+  for (auto& role : dual_roles) {
+    role.state = DUAL_ROLE_IDLE;
+  }
+  memset(layers.pressed_key, 0, sizeof(layers.pressed_key));
+  memset(turbo.held, 0, sizeof(turbo.held));
+  memset(turbo.key_down, 0, sizeof(turbo.key_down));
+  for (auto& finger : touchpad.fingers) {
+    finger = touchpad_finger(); // motion and lifts of fingers already down are ignored
+  }
+  touchpad.pointer_fingers = 0;
+  touchpad.click_button = 0;
+  layers.layer_used = true; // don't send a tap for chord buttons held across the sweep
+  flushEvents();
+
+  bool changed = false;
+  for (int i = 0; i < KEY_CNT / (int)KEY_STATE_BITS; i++) {
+    for (unsigned long held = key_state.pressed[i]; held != 0; held &= held - 1) {
+      emitKeyEvent(i * KEY_STATE_BITS + __builtin_ctzl(held), 0);
+      changed = true;
+    }
+    key_state.pressed[i] = 0;
+  }
+  memset(key_state.refcount, 0, sizeof(key_state.refcount));
+
+  if (xbox360_mode) {
+    for (int code = 0; code < ABS_CNT; code++) {
+      if (output.abs_value[code] != 0) {
+        output.abs_value[code] = 0;
+        emit(EV_ABS, code, 0);
+        changed = true;
+      }
+    }
+  }
+
+  if (changed) {
+    emit(EV_SYN, SYN_REPORT, 0);
+  }
+  flushEvents();
+
+  // the keys are gone, so forget which mappings held them
+  state.mouseX = 0;
+  state.mouseY = 0;
+  state.wheel_x_speed = state.wheel_y_speed = 0.0f;
+  state.left_analog_was_up = state.left_analog_was_down = false;
+  state.left_analog_was_left = state.left_analog_was_right = false;
+  state.right_analog_was_up = state.right_analog_was_down = false;
+  state.right_analog_was_left = state.right_analog_was_right = false;
+  state.l2_was_pressed = state.r2_was_pressed = false;
+}
+
+void emitTextKeyStroke(int code, int modifiers)
+{
+  if (modifiers & TEXT_SHIFT) { //capitalise capital letters by holding shift
+    emitKey(KEY_LEFTSHIFT, true);
+  }
+  if (modifiers & TEXT_ALTGR) {
+    emitKey(KEY_RIGHTALT, true);
+  }
+  emitKey(code, true);
+  flushAndDelay(16);
+  emitKey(code, false);
+  flushAndDelay(16);
+  if (modifiers & TEXT_ALTGR) {
+    emitKey(KEY_RIGHTALT, false);
+  }
+  if (modifiers & TEXT_SHIFT) { //release shift if held
+    emitKey(KEY_LEFTSHIFT, false);
+  }
+}
+
+void emitTextInputKey(int code, bool uppercase)
+{
+  emitTextKeyStroke(code, uppercase ? TEXT_SHIFT : 0);
+}
+
+// Type a character from the layout tables, after its dead key if it needs one
+void typeTextKey(const text_key& key)
+{
+  if (key.dead != 0) {
+    emitTextKeyStroke(text_layout.dead_keys[key.dead].code, text_layout.dead_keys[key.dead].modifiers);
+  }
+  emitTextKeyStroke(key.code, key.modifiers);
+}
+
+void addTextInputCharacter()
+{
+  typeTextKey(character_set[current_key[current_character]]);
+}
+
+void removeTextInputCharacter()
+{
+  emitTextInputKey(KEY_BACKSPACE,false); //delete one character
+}
+
+void confirmTextInputCharacter()
+{
+  emitTextInputKey(KEY_ENTER,false); //emit ENTER to confirm text input
+}
+
+void nextTextInputKey(bool SingleIncrease) // enable fast skipping if SingleIncrease = false
+{
+  removeTextInputCharacter(); //delete character(s)
+  if (SingleIncrease) {
+    current_key[current_character]++;
+  } else {
+    current_key[current_character] = current_key[current_character] + 13; // jump forward by half alphabet
+  }
+  if (current_key[current_character] >= maxKeys) {
+     current_key[current_character] = current_key[current_character] - maxKeys;
+  } else if ((current_character == 0) && (character_set[current_key[current_character]].code == KEY_SPACE)) {
+      current_key[current_character]++; //skip space as first character 
+  }
+
+  addTextInputCharacter(); //add new character
+}
+
+void prevTextInputKey(bool SingleDecrease)
+{
+  removeTextInputCharacter(); //delete character(s)
+  if (SingleDecrease) {
+    current_key[current_character]--;
+  } else {
+    current_key[current_character] = current_key[current_character] - 13; // jump back by half alphabet  
+  }
+  if (current_key[current_character] < 0) {
+     current_key[current_character] = current_key[current_character] + maxKeys;
+  } else if ((current_character == 0) && (character_set[current_key[current_character]].code == KEY_SPACE)) {
+      current_key[current_character]--; //skip space as first character due to weird graphical issue with Exult
+  }
+  addTextInputCharacter(); //add new character
+}
+
+#define DAISYWHEEL_GROUPS 8
+
+// Daisywheel text entry: the left stick picks one of 8 groups, clockwise from
+// up, and X, Y, B and A type the first to fourth character of the group.
+// Only the chosen character is sent, instead of stepping through the alphabet
+const char* const daisywheel_groups[2][DAISYWHEEL_GROUPS] = {
+  {"abcd", "efgh", "ijkl", "mnop", "qrst", "uvwx", "yz.,", "-_()"},
+  {"1234", "5678", "90@#", "!?&*", "+=/%", "'\":;", "<>[]", "~|\\$"}, // while R1 is held
+};
+
+struct
+{
+  int group = -1; // selected by the left stick, -1 while it is centred
+  bool capitals = false; // L1 held
+  bool symbols = false; // R1 held
+  int typed = 0; // characters to delete if entry is cancelled
+} daisywheel;
+
+// The stick is classified like an 8-way analog stick, so the diagonal
+// groups follow analog_diagonal_width
+void selectDaisywheelGroup(int x, int y, int raw_x, int raw_y)
+{
+  switch (analogDirections(x, y, raw_x, raw_y, ANALOG_MODE_8WAY)) {
+    case ANALOG_DIR_UP: daisywheel.group = 0; break;
+    case ANALOG_DIR_UP | ANALOG_DIR_RIGHT: daisywheel.group = 1; break;
+    case ANALOG_DIR_RIGHT: daisywheel.group = 2; break;
+    case ANALOG_DIR_DOWN | ANALOG_DIR_RIGHT: daisywheel.group = 3; break;
+    case ANALOG_DIR_DOWN: daisywheel.group = 4; break;
+    case ANALOG_DIR_DOWN | ANALOG_DIR_LEFT: daisywheel.group = 5; break;
+    case ANALOG_DIR_LEFT: daisywheel.group = 6; break;
+    case ANALOG_DIR_UP | ANALOG_DIR_LEFT: daisywheel.group = 7; break;
+    default: daisywheel.group = -1; break; // centred
+  }
+}
+
+void typeDaisywheelCharacter(int position)
+{
+  char c = daisywheel_groups[daisywheel.symbols][daisywheel.group][position];
+  if (daisywheel.capitals && c >= 'a' && c <= 'z') {
+    c = c - 'a' + 'A';
+  }
+  if (const text_key* key = textKey(c)) {
+    typeTextKey(*key);
+    daisywheel.typed++;
+  }
+}
+
+void leaveDaisywheel(bool confirm)
+{
+  if (confirm) {
+    confirmTextInputCharacter();
+  } else {
+    for (; daisywheel.typed > 0; daisywheel.typed--) {
+      removeTextInputCharacter();
+    }
+  }
+  daisywheel.typed = 0;
+  state.textinputinteractive_mode_active = false;
+  releaseAllKeys();
+  logMessage(LOG_INFO, "text input interactive mode no longer active\n");
+}
+
+void handleDaisywheelButton(Uint8 button, bool is_pressed)
+{
+  switch (button) {
+    case SDL_CONTROLLER_BUTTON_LEFTSHOULDER:
+      daisywheel.capitals = is_pressed;
+      return;
+    case SDL_CONTROLLER_BUTTON_RIGHTSHOULDER:
+      daisywheel.symbols = is_pressed;
+      return;
+  }
+  if (!is_pressed) {
+    return;
+  }
+
+  // with the stick centred the face buttons edit instead
+  const int position =
+    button == SDL_CONTROLLER_BUTTON_X ? 0 :
+    button == SDL_CONTROLLER_BUTTON_Y ? 1 :
+    button == SDL_CONTROLLER_BUTTON_B ? 2 :
+    button == SDL_CONTROLLER_BUTTON_A ? 3 : -1;
+  if (position >= 0 && daisywheel.group >= 0) {
+    typeDaisywheelCharacter(position);
+    return;
+  }
+
+  switch (button) {
+    case SDL_CONTROLLER_BUTTON_X:
+    case SDL_CONTROLLER_BUTTON_DPAD_LEFT:
+      removeTextInputCharacter();
+      if (daisywheel.typed > 0) daisywheel.typed--;
+      break;
+    case SDL_CONTROLLER_BUTTON_Y:
+    case SDL_CONTROLLER_BUTTON_DPAD_RIGHT:
+      emitTextInputKey(KEY_SPACE, false);
+      daisywheel.typed++;
+      break;
+    case SDL_CONTROLLER_BUTTON_A:
+    case SDL_CONTROLLER_BUTTON_START:
+      leaveDaisywheel(true);
+      break;
+    case SDL_CONTROLLER_BUTTON_LEFTSTICK: // hotkey override
+    case SDL_CONTROLLER_BUTTON_BACK:
+      leaveDaisywheel(false);
+      break;
+  }
+}
+
+void setInputRepeat(int code, bool is_pressed)
+{
+  if (is_pressed) {
+    state.key_to_repeat = code;
+    state.key_repeat_text_input = true;
+    state.key_repeat_at = monotonicTimeUs() + config.key_repeat_interval * 1000; // text input repeats at the repeat interval from the start
+  } else {
+    stopKeyRepeat();
+  }
+}
+
+
+// TEXTINPUTPRESET compiled once at startup, so typing it is just a walk over the keys
+std::vector<text_key> text_plan;
+
+void compileTextPreset(const char* text)
+{
+  text_plan.clear();
+  text_plan.reserve(strlen(text));
+  while (*text != '\0') {
+    const Uint32 code_point = decodeUtf8(text);
+    if (const text_key* key = textKey(code_point)) {
+      text_plan.push_back(*key);
+    } else if (code_point == '\n') {
+      text_plan.push_back({KEY_ENTER, 0, 0});
+    } else if (code_point == '\t') {
+      text_plan.push_back({KEY_TAB, 0, 0});
+    } else {
+      printf("text input preset: keyboard layout %s can't type U+%04X, skipped\n",
+        keyboard_layouts[config.keyboard_layout].name, code_point);
+    }
+  }
+}
+
+// Hold a text key down, after tapping its dead key if it needs one
+void pressTextKey(const text_key& key)
+{
+  if (key.dead != 0) {
+    const text_key& dead = text_layout.dead_keys[key.dead];
+    if (dead.modifiers & TEXT_ALTGR) emitKey(KEY_RIGHTALT, true);
+    emitKey(dead.code, true, dead.modifiers & TEXT_SHIFT ? MODIFIER_SHIFT : 0);
+    emitKey(dead.code, false, dead.modifiers & TEXT_SHIFT ? MODIFIER_SHIFT : 0);
+    if (dead.modifiers & TEXT_ALTGR) emitKey(KEY_RIGHTALT, false);
+  }
+  if (key.modifiers & TEXT_ALTGR) emitKey(KEY_RIGHTALT, true);
+  emitKey(key.code, true, key.modifiers & TEXT_SHIFT ? MODIFIER_SHIFT : 0);
+}
+
+void releaseTextKey(const text_key& key)
+{
+  emitKey(key.code, false, key.modifiers & TEXT_SHIFT ? MODIFIER_SHIFT : 0);
+  if (key.modifiers & TEXT_ALTGR) emitKey(KEY_RIGHTALT, false);
+}
+
+#define TEXT_STREAM_BUFFER 4096
+#define TEXT_STREAM_START_US 1000000 // give the game a moment to pick up the new keyboard
+#define TEXT_STREAM_POLL_US 100000 // how often an empty FIFO is checked when the loop can't sleep on it
+
+// --type-file: text read a buffer at a time from a file or FIFO and typed
+// from the main loop at config.type_rate. Each tick types type_burst
+// characters and keeps the last one held until halfway to the next tick, so
+// games that only look at the keyboard state once a frame still see it.
+// The text input preset is typed the same way, ahead of the file
+struct
+{
+  bool typing_plan = false; // text_plan from plan_next on comes first
+  size_t plan_next = 0;
+  const char* path = NULL;
+  int fd = -1;
+  bool fifo = false; // kept open for writing too, so it never reaches end of file
+  char buffer[TEXT_STREAM_BUFFER];
+  int start = 0; // unread text is buffer[start] to buffer[end]
+  int end = 0;
+  bool end_of_file = false;
+  bool waiting = false; // FIFO empty, the main loop wakes when it can be read
+  text_key held;
+  bool holding = false;
+  Uint64 tick_at = 0; // next tick, 0 if there is none
+  Uint64 release_at = 0;
+} text_stream;
+
+void openTextStream()
+{
+  if (text_stream.path == NULL) return;
+  if (xbox360_mode) {
+    logMessage(LOG_WARN, "--type-file needs the keyboard device, not xbox360 mode\n");
+    return;
+  }
+  struct stat info;
+  if (stat(text_stream.path, &info) != 0) {
+    logMessage(LOG_ERROR, "can't type %s: %s\n", text_stream.path, strerror(errno));
+    return;
+  }
+  text_stream.fifo = S_ISFIFO(info.st_mode);
+  text_stream.fd = open(text_stream.path, (text_stream.fifo ? O_RDWR : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+  if (text_stream.fd < 0) {
+    logMessage(LOG_ERROR, "can't type %s: %s\n", text_stream.path, strerror(errno));
+    return;
+  }
+  text_stream.tick_at = monotonicTimeUs() + TEXT_STREAM_START_US;
+}
+
+// Bytes in a UTF-8 sequence, from its first byte
+int utf8Length(unsigned char lead)
+{
+  return lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+}
+
+// The next typable character of the stream, reading more when the buffer runs out.
+// Returns false if none is available yet, or at end of file
+bool nextStreamKey(text_key& key)
+{
+  if (text_stream.typing_plan) {
+    if (text_stream.plan_next < text_plan.size()) {
+      key = text_plan[text_stream.plan_next++];
+      return true;
+    }
+    text_stream.typing_plan = false;
+  }
+  if (text_stream.fd < 0) {
+    return false;
+  }
+  while (true) {
+    const int available = text_stream.end - text_stream.start;
+    if (available == 0 || available < utf8Length(text_stream.buffer[text_stream.start])) {
+      if (text_stream.end_of_file) {
+        return false;
+      }
+      memmove(text_stream.buffer, text_stream.buffer + text_stream.start, available);
+      text_stream.start = 0;
+      text_stream.end = available;
+      const ssize_t bytes = read(text_stream.fd, text_stream.buffer + available, TEXT_STREAM_BUFFER - available);
+      if (bytes > 0) {
+        text_stream.end += bytes;
+        continue;
+      }
+      if (bytes == 0 || errno != EAGAIN) {
+        text_stream.end_of_file = true; // a partial character left at the end is dropped
+      } else {
+        text_stream.waiting = true;
+      }
+      return false;
+    }
+
+    const char* text = text_stream.buffer + text_stream.start;
+    const Uint32 code_point = decodeUtf8(text);
+    text_stream.start = text - text_stream.buffer;
+    if (const text_key* typed = textKey(code_point)) {
+      key = *typed;
+      return true;
+    } else if (code_point == '\n') {
+      key = {KEY_ENTER, 0, 0};
+      return true;
+    } else if (code_point == '\t') {
+      key = {KEY_TAB, 0, 0};
+      return true;
+    } else if (code_point != '\r') {
+      logMessage(LOG_WARN, "--type-file: keyboard layout %s can't type U+%04X, skipped\n",
+        keyboard_layouts[config.keyboard_layout].name, code_point);
+    }
+  }
+}
+
+void runTextStream(Uint64 now)
+{
+  if (text_stream.waiting && power.extra_ready) {
+    text_stream.waiting = false;
+    power.extra_ready = false;
+    power.extra_fd = -1;
+    text_stream.tick_at = now;
+  } else if (text_stream.waiting && power.extra_fd == text_stream.fd && !powerSleepsInPoll()) {
+    // a controller that can't be watched turned up, so extra_fd would never be seen
+    text_stream.waiting = false;
+    power.extra_fd = -1;
+    text_stream.tick_at = now;
+  }
+  if (text_stream.holding && text_stream.release_at <= now) {
+    releaseTextKey(text_stream.held);
+    text_stream.holding = false;
+  }
+  if (text_stream.tick_at == 0 || text_stream.tick_at > now || text_stream.holding) {
+    return;
+  }
+
+  const Uint64 interval = 1000000ULL * config.type_burst / config.type_rate;
+  text_key key;
+  int typed = 0;
+  while (typed < config.type_burst && nextStreamKey(key)) {
+    if (typed > 0) {
+      releaseTextKey(text_stream.held);
+    }
+    pressTextKey(key);
+    text_stream.held = key;
+    typed++;
+  }
+  if (typed > 0) {
+    text_stream.holding = true;
+    text_stream.release_at = now + interval / 2;
+    text_stream.tick_at = now + interval;
+  } else if (text_stream.waiting) {
+    if (powerSleepsInPoll()) {
+      text_stream.tick_at = 0; // until the FIFO has more
+      power.extra_fd = text_stream.fd;
+    } else {
+      text_stream.waiting = false;
+      text_stream.tick_at = now + TEXT_STREAM_POLL_US;
+    }
+  } else {
+    if (text_stream.fd >= 0) {
+      logMessage(LOG_INFO, "finished typing %s\n", text_stream.path);
+      close(text_stream.fd);
+      text_stream.fd = -1;
+    }
+    text_stream.tick_at = 0;
+  }
+}
+
+// Start typing the text input preset; the main loop types it at type_rate
+void processKeys()
+{
+  text_stream.typing_plan = true;
+  text_stream.plan_next = 0;
+  if (text_stream.tick_at == 0 && !text_stream.holding) {
+    text_stream.tick_at = monotonicTimeUs();
+  }
+}
+
+Uint64 nextTextStreamDeadline()
+{
+  return text_stream.holding ? text_stream.release_at : text_stream.tick_at;
+}
+
+#define DICTIONARY_NODES_INITIAL 4096
+
+// Word list for interactive text input, as a trie of lower case letters.
+// Words earlier in the list count as more likely, and as ranks only grow
+// while loading, each node keeps the rank of the first word through it
+struct dictionary_node
+{
+  Uint32 first_child; // 0 for none; the root is node 0 and never a child
+  Uint32 next_sibling;
+  Uint32 best; // rank of the most likely word through this node
+  char letter;
+  bool word_end;
+};
+
+// Loaded by a helper thread so startup isn't held up; the main thread only
+// looks at it once ready is set
+struct
+{
+  const char* path = NULL; // TEXTINPUTDICTIONARY
+  std::vector<dictionary_node> nodes;
+  bool ready = false;
+} dictionary;
+
+Uint32 dictionaryChild(Uint32 node, char letter)
+{
+  for (Uint32 child = dictionary.nodes[node].first_child; child != 0; child = dictionary.nodes[child].next_sibling) {
+    if (dictionary.nodes[child].letter == letter) return child;
+  }
+  return 0;
+}
+
+// The child leading to the node's most likely word, 0 if that word ends here
+Uint32 dictionaryBestChild(Uint32 node)
+{
+  for (Uint32 child = dictionary.nodes[node].first_child; child != 0; child = dictionary.nodes[child].next_sibling) {
+    if (dictionary.nodes[child].best == dictionary.nodes[node].best) return child;
+  }
+  return 0;
+}
+
+void addDictionaryWord(const char* word, int length, Uint32 rank)
+{
+  Uint32 node = 0;
+  for (int i = 0; i < length; i++) {
+    Uint32 child = dictionaryChild(node, word[i]);
+    if (child == 0) {
+      child = dictionary.nodes.size();
+      dictionary.nodes.push_back({0, dictionary.nodes[node].first_child, rank, word[i], false});
+      dictionary.nodes[node].first_child = child;
+    }
+    node = child;
+  }
+  dictionary.nodes[node].word_end = true;
+}
+
+// One word per line, most common first; lines with anything but letters are skipped
+int loadDictionary(void*)
+{
+  const int fd = open(dictionary.path, O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+    logMessage(LOG_WARN, "can't read dictionary %s\n", dictionary.path);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  const char* text = (const char*)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (text == MAP_FAILED) {
+    logMessage(LOG_WARN, "can't load dictionary %s\n", dictionary.path);
+    return -1;
+  }
+  dictionary.nodes.reserve(DICTIONARY_NODES_INITIAL);
+  dictionary.nodes.push_back({0, 0, 0, 0, false}); // the root
+
+  char word[maxChars];
+  int length = 0;
+  bool usable = true;
+  Uint32 words = 0;
+  for (off_t i = 0; i <= info.st_size; i++) {
+    const char c = i < info.st_size ? text[i] : '\n';
+    if (c == '\n' || c == '\r') {
+      if (length > 0 && usable) addDictionaryWord(word, length, words++);
+      length = 0;
+      usable = true;
+    } else if (((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) && length < maxChars) {
+      word[length++] = c | 0x20; // lower case
+    } else {
+      usable = false;
+    }
+  }
+  munmap((void*)text, info.st_size);
+
+  logMessage(LOG_INFO, "dictionary %s: %u words\n", dictionary.path, words);
+  __atomic_store_n(&dictionary.ready, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void startDictionary()
+{
+  if (dictionary.path == NULL || !textinputinteractive_mode) return;
+  if (SDL_Thread* thread = SDL_CreateThread(loadDictionary, "dictionary", NULL)) {
+    SDL_DetachThread(thread);
+  }
+}
+
+// The trie node for the word typed up to and including character last,
+// 0 (the root) at the start of a word, or -1 if it isn't in the dictionary
+long dictionaryPrefix(int last)
+{
+  if (!__atomic_load_n(&dictionary.ready, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  int start = last + 1;
+  while (start > 0 && current_key[start - 1] < 52) { // 0-25 are capitals, 26-51 lower case
+    start--;
+  }
+  if (start > 0 && character_set[current_key[start - 1]].code != KEY_SPACE) {
+    return -1; // follows a digit or symbol
+  }
+  Uint32 node = 0;
+  for (int i = start; i <= last; i++) {
+    node = dictionaryChild(node, 'a' + current_key[i] % 26);
+    if (node == 0) return -1;
+  }
+  return node;
+}
+
+// Start a new character at the most likely next letter, keeping its case
+void predictTextInputKey()
+{
+  const long node = dictionaryPrefix(current_character - 1);
+  if (node < 0) {
+    return;
+  }
+  Uint32 likely = 0;
+  for (Uint32 child = dictionary.nodes[node].first_child; child != 0; child = dictionary.nodes[child].next_sibling) {
+    if (likely == 0 || dictionary.nodes[child].best < dictionary.nodes[likely].best) {
+      likely = child;
+    }
+  }
+  if (likely != 0) {
+    current_key[current_character] = (current_key[current_character] < 26 ? 0 : 26) + dictionary.nodes[likely].letter - 'a';
+  }
+}
+
+// Type the rest of the most likely word starting with what has been typed, all
+// in one write. Returns false if there is no suggestion
+bool acceptTextInputSuggestion()
+{
+  const long found = dictionaryPrefix(current_character);
+  if (found <= 0) {
+    return false;
+  }
+  Uint32 node = found;
+  const int bucket = current_key[current_character] < 26 ? 0 : 26; // in the case of the letter it follows
+  int added = 0;
+  while (current_character + 1 < maxChars) {
+    node = dictionaryBestChild(node);
+    if (node == 0) break;
+    current_key[++current_character] = bucket + dictionary.nodes[node].letter - 'a';
+    pressTextKey(character_set[current_key[current_character]]);
+    releaseTextKey(character_set[current_key[current_character]]);
+    added++;
+  }
+  flushEvents();
+  return added > 0;
+}
+
+void setKeyRepeat(int code, bool is_pressed)
+{
+  if (is_pressed) {
+    state.key_to_repeat=code;
+    state.key_repeat_text_input = false;
+    state.key_repeat_at = monotonicTimeUs() + config.key_repeat_delay * 1000; // for a new repeat, use repeat delay for first time, then switch to repeat interval
+  } else {
+    stopKeyRepeat();
+  }
+}
+
+// Key repeat runs from the main loop's timer wait rather than an SDL timer thread
+void runKeyRepeat(Uint64 now)
+{
+  if (state.key_to_repeat == 0 || state.key_repeat_at > now) {
+    return;
+  }
+
+  state.key_repeat_at = now + config.key_repeat_interval * 1000; // key repeats according to repeat interval
+  stats.counters.repeats++;
+  if (!state.key_repeat_text_input) {
+    emitKeyRepeat(state.key_to_repeat);
+  } else if (state.textinputinteractive_mode_active && state.key_to_repeat == KEY_UP) {
+    prevTextInputKey(true);
+  } else if (state.textinputinteractive_mode_active && state.key_to_repeat == KEY_DOWN) {
+    nextTextInputKey(true);
+  }
+}
+
+Uint64 nextKeyRepeatDeadline()
+{
+  return state.key_to_repeat != 0 ? state.key_repeat_at : 0;
+}
+void emitAxisMotion(int code, int value)
+{
+  if (output.abs_is_pending[code]) {
+    // sticks only need their latest position, but a d-pad press and release
+    // arriving in the same batch must not cancel out, so give the hat its own frame
+    if ((code == ABS_HAT0X || code == ABS_HAT0Y) && output.abs_value[code] != value) {
+      queueMotion();
+    } else {
+      output.abs_value[code] = value;
+      return;
+    }
+  }
+
+  output.abs_value[code] = value;
+  output.abs_is_pending[code] = true;
+  output.abs_pending[output.abs_pending_count++] = code;
+}
+
+void emitMouseMotion(int x, int y)
+{
+  if (pointer.fd >= 0) {
+    movePointer(pointer.x + x, pointer.y + y);
+    return;
+  }
+  output.rel_x += x;
+  output.rel_y += y;
+}
+
+// Scroll by hi-res wheel units, MOUSE_WHEEL_NOTCH to a notch; up and right are positive
+void emitWheel(int vertical, int horizontal)
+{
+  output.wheel += vertical;
+  output.hwheel += horizontal;
+}
+
+// Sticks used as a mouse or wheel move once per mouse tick while deflected
+bool mouseMoving()
+{
+  return state.mouseX != 0 || state.mouseY != 0 || state.wheel_x_speed != 0.0f || state.wheel_y_speed != 0.0f;
+}
+
+// A slightly deflected stick moves the mouse a pixel or two each tick. With
+// power_save such ticks are stretched, each moving further, so the speed stays
+// the same with fewer wakeups
+int mouseTickStretch()
+{
+  if (!config.power_save) return 1;
+  int stretch = MOUSE_TICK_STRETCH_MAX;
+  const int step = std::max(std::abs(state.mouseX), std::abs(state.mouseY));
+  if (step > 0) {
+    stretch = std::min(stretch, std::max(1, MOUSE_TICK_MIN_STEP / step));
+  }
+  const float wheel = std::max(fabsf(state.wheel_x_speed), fabsf(state.wheel_y_speed));
+  if (wheel > 0.0f) {
+    stretch = std::min(stretch, std::max(1, (int)(MOUSE_TICK_MIN_WHEEL_STEP / wheel)));
+  }
+  return stretch;
+}
+
+void emitMouseTick(int stretch)
+{
+  stats.counters.mouse_ticks++;
+  if (state.mouseX != 0 || state.mouseY != 0) {
+    emitMouseMotion(state.mouseX * stretch, state.mouseY * stretch);
+  }
+  state.wheel_remainder_x += state.wheel_x_speed * stretch;
+  state.wheel_remainder_y += state.wheel_y_speed * stretch;
+  const int x = (int)state.wheel_remainder_x;
+  const int y = (int)state.wheel_remainder_y;
+  state.wheel_remainder_x -= x;
+  state.wheel_remainder_y -= y;
+  emitWheel(y, x);
+}
+
+// Position mode: the stick's deflection picks a point in mouse_absolute_region,
+// centred when the stick is at rest
+void emitPointerPosition(int stick_x, int stick_y)
+{
+  const int* region = config.mouse_absolute_region;
+  const long left = (long)region[0] * config.mouse_absolute_width / 100;
+  const long top = (long)region[1] * config.mouse_absolute_height / 100;
+  const long width = (long)(region[2] - region[0]) * config.mouse_absolute_width / 100;
+  const long height = (long)(region[3] - region[1]) * config.mouse_absolute_height / 100;
+  movePointer(
+    left + width / 2 + (long)stick_x * width / 65536,
+    top + height / 2 + (long)stick_y * height / 65536);
+}
+
+#define GYRO_SMOOTHING_FACTOR 0.25f // weight of each new sample in the smoothed slow motion
+#define GYRO_STILL_THRESHOLD 0.02f // rad/s; slower than this while not aiming counts as resting
+#define GYRO_DRIFT_RATE 0.002f // how quickly the drift estimate follows a resting controller
+#define GYRO_MAX_PERIOD 0.05f // longest gap in seconds integrated, so a stalled sensor can't jump the pointer
+
+struct
+{
+  SDL_JoystickID controller = -1; // instance with its gyro enabled, -1 if none
+  float period = 0.0f; // seconds between samples from the reported rate, 0 to use timestamps
+  Uint32 last_timestamp = 0;
+  bool calibrating = false;
+  Uint32 calibrate_until = 0; // SDL ticks, set from the first sample
+  float calibration_x = 0.0f;
+  float calibration_y = 0.0f;
+  int calibration_count = 0;
+  float bias_x = 0.0f; // rad/s reported by the controller at rest
+  float bias_y = 0.0f;
+  float smooth_x = 0.0f;
+  float smooth_y = 0.0f;
+  float remainder_x = 0.0f; // sub-pixel motion carried over to the next sample
+  float remainder_y = 0.0f;
+  bool button_held = false;
+} gyro;
+
+void enableGyro(SDL_GameController* controller)
+{
+  if (!config.gyro_mouse || xbox360_mode || controller == NULL || gyro.controller != -1) return;
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+  if (!SDL_GameControllerHasSensor(controller, SDL_SENSOR_GYRO)
+    || SDL_GameControllerSetSensorEnabled(controller, SDL_SENSOR_GYRO, SDL_TRUE) != 0) {
+    logMessage(LOG_WARN, "controller has no usable gyro\n");
+    return;
+  }
+  const float rate = SDL_GameControllerGetSensorDataRate(controller, SDL_SENSOR_GYRO);
+  gyro.controller = SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(controller));
+  gyro.period = rate > 0.0f ? 1.0f / rate : 0.0f;
+  gyro.last_timestamp = 0;
+  gyro.calibrating = config.gyro_calibration > 0;
+  gyro.calibration_x = gyro.calibration_y = 0.0f;
+  gyro.calibration_count = 0;
+  gyro.bias_x = gyro.bias_y = 0.0f;
+  gyro.smooth_x = gyro.smooth_y = 0.0f;
+  gyro.remainder_x = gyro.remainder_y = 0.0f;
+  logMessage(LOG_INFO, "gyro enabled at %.0f Hz, keep the controller still for %d ms to calibrate\n", rate, config.gyro_calibration);
+#else
+  logMessage(LOG_WARN, "gyro aiming needs SDL 2.0.16 or newer\n");
+#endif
+}
+
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+// Turns one gyro sample into mouse motion. Yaw moves the pointer across and
+// pitch moves it up and down; the motion joins the batched mouse output
+void handleGyro(const SDL_ControllerSensorEvent& sensor)
+{
+  if (sensor.which != gyro.controller) return;
+
+  float dt = gyro.period;
+  if (dt == 0.0f) {
+    dt = gyro.last_timestamp != 0 ? (sensor.timestamp - gyro.last_timestamp) / 1000.0f : 0.0f;
+  }
+  if (dt > GYRO_MAX_PERIOD) dt = GYRO_MAX_PERIOD;
+  gyro.last_timestamp = sensor.timestamp;
+
+  // radians per second, counter-clockwise positive: data[0] is pitch, data[1] is yaw
+  const float yaw = sensor.data[1];
+  const float pitch = sensor.data[0];
+
+  if (gyro.calibrating) {
+    if (gyro.calibration_count == 0) {
+      gyro.calibrate_until = sensor.timestamp + config.gyro_calibration;
+    }
+    gyro.calibration_x += yaw;
+    gyro.calibration_y += pitch;
+    gyro.calibration_count++;
+    if ((Sint32)(sensor.timestamp - gyro.calibrate_until) >= 0) {
+      gyro.bias_x = gyro.calibration_x / gyro.calibration_count;
+      gyro.bias_y = gyro.calibration_y / gyro.calibration_count;
+      gyro.calibrating = false;
+      logMessage(LOG_INFO, "gyro calibrated from %d samples\n", gyro.calibration_count);
+    }
+    return;
+  }
+
+  float x = yaw - gyro.bias_x;
+  float y = pitch - gyro.bias_y;
+
+  const bool aiming = (config.gyro_button == SDL_CONTROLLER_BUTTON_INVALID || gyro.button_held)
+    && !state.textinputinteractive_mode_active;
+  if (!aiming) {
+    // keep following drift while the gyro isn't steering and the controller looks to be at rest
+    if (fabsf(x) < GYRO_STILL_THRESHOLD && fabsf(y) < GYRO_STILL_THRESHOLD) {
+      gyro.bias_x += x * GYRO_DRIFT_RATE;
+      gyro.bias_y += y * GYRO_DRIFT_RATE;
+    }
+    gyro.smooth_x = gyro.smooth_y = 0.0f;
+    gyro.remainder_x = gyro.remainder_y = 0.0f;
+    return;
+  }
+
+  // slow movement, which is mostly hand shake, is averaged; faster turns pass straight through
+  gyro.smooth_x += (x - gyro.smooth_x) * GYRO_SMOOTHING_FACTOR;
+  gyro.smooth_y += (y - gyro.smooth_y) * GYRO_SMOOTHING_FACTOR;
+  const float speed = sqrtf(x * x + y * y) * (float)(180.0 / M_PI); // degrees per second
+  if (config.gyro_smoothing > 0.0f) {
+    float direct = (speed - config.gyro_smoothing / 2) / (config.gyro_smoothing / 2);
+    if (direct < 0.0f) direct = 0.0f;
+    if (direct > 1.0f) direct = 1.0f;
+    x = x * direct + gyro.smooth_x * (1.0f - direct);
+    y = y * direct + gyro.smooth_y * (1.0f - direct);
+  }
+
+  // sensitivity ramps from gyro_sensitivity to gyro_sensitivity_max as the turn speeds up
+  float sensitivity = config.gyro_sensitivity;
+  if (config.gyro_sensitivity_max >= 0.0f && config.gyro_accel_speed > 0.0f) {
+    const float ramp = speed >= config.gyro_accel_speed ? 1.0f : speed / config.gyro_accel_speed;
+    sensitivity += (config.gyro_sensitivity_max - config.gyro_sensitivity) * ramp;
+  }
+
+  // turning left or tilting the top up is positive, and moves the pointer left or up
+  const float scale = sensitivity * dt * (float)(180.0 / M_PI);
+  gyro.remainder_x -= x * scale;
+  gyro.remainder_y -= y * scale;
+  const int dx = (int)gyro.remainder_x;
+  const int dy = (int)gyro.remainder_y;
+  gyro.remainder_x -= dx;
+  gyro.remainder_y -= dy;
+  if (dx != 0 || dy != 0) {
+    emitMouseMotion(dx, dy);
+  }
+}
+#endif
+
+#define TOUCHPAD_TAP_TIME 200 // ms a tap may last
+#define TOUCHPAD_TAP_TRAVEL 0.03f // how far a finger may move during a tap, as a fraction of the touchpad
+#define TOUCHPAD_ASPECT 0.5f // touchpad height / width, roughly that of DualShock 4 and DualSense pads
+
+// The region a finger at x, y presses, 0 for none; regions without a key act as the plain touchpad
+int touchpadRegionAt(float x, float y)
+{
+  for (int region = 1; region <= TOUCHPAD_REGION_MAX; region++) {
+    const int* bounds = config.touchpad_region[region];
+    if (config.touchpad_region_key[region] != 0 && bounds[2] > bounds[0] && bounds[3] > bounds[1]
+      && x * 100 >= bounds[0] && x * 100 < bounds[2] && y * 100 >= bounds[1] && y * 100 < bounds[3]) {
+      return region;
+    }
+  }
+  return 0;
+}
+
+// Pressed now and released from the main loop, like a tapped macro key
+void tapTouchpad(int button)
+{
+  if (touchpad.click_button != 0) {
+    emitKey(touchpad.click_button, false);
+  }
+  emitKey(button, true);
+  touchpad.click_button = button;
+  touchpad.click_release_at = monotonicTimeUs() + MACRO_TAP_DELAY * 1000;
+}
+
+void runTouchpad(Uint64 now)
+{
+  if (touchpad.click_button != 0 && touchpad.click_release_at <= now) {
+    emitKey(touchpad.click_button, false);
+    touchpad.click_button = 0;
+  }
+}
+
+Uint64 nextTouchpadDeadline()
+{
+  return touchpad.click_button != 0 ? touchpad.click_release_at : 0;
+}
+
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+// One finger moves the pointer, two scroll, and a short touch without travel
+// clicks (left for one finger, right for two). A finger that lands in a region
+// holds that region's key until it is lifted and is otherwise ignored
+void handleTouchpad(Uint32 type, const SDL_ControllerTouchpadEvent& touch)
+{
+  if (!config.touchpad_mouse || touch.touchpad != 0 || touch.finger < 0 || touch.finger >= TOUCHPAD_FINGER_MAX) {
+    return;
+  }
+  touchpad_finger& finger = touchpad.fingers[touch.finger];
+
+  if (type == SDL_CONTROLLERTOUCHPADDOWN) {
+    if (finger.down) return;
+    finger.down = true;
+    finger.x = touch.x;
+    finger.y = touch.y;
+    finger.travel = 0.0f;
+    finger.region = touchpadRegionAt(touch.x, touch.y);
+    if (finger.region != 0) {
+      emitKey(config.touchpad_region_key[finger.region], true, config.touchpad_region_modifier[finger.region]);
+      return;
+    }
+    if (touchpad.pointer_fingers == 0) {
+      touchpad.gesture_start = touch.timestamp;
+      touchpad.gesture_fingers = 0;
+      touchpad.gesture_moved = false;
+    }
+    touchpad.pointer_fingers++;
+    if (touchpad.pointer_fingers > touchpad.gesture_fingers) {
+      touchpad.gesture_fingers = touchpad.pointer_fingers;
+    }
+  } else if (type == SDL_CONTROLLERTOUCHPADMOTION) {
+    if (!finger.down || finger.region != 0) return;
+    const float dx = touch.x - finger.x;
+    const float dy = (touch.y - finger.y) * TOUCHPAD_ASPECT;
+    finger.x = touch.x;
+    finger.y = touch.y;
+    finger.travel += fabsf(dx) + fabsf(dy);
+    if (finger.travel > TOUCHPAD_TAP_TRAVEL) {
+      touchpad.gesture_moved = true;
+    }
+
+    if (touchpad.pointer_fingers == 1) {
+      touchpad.remainder_x += dx * config.touchpad_sensitivity;
+      touchpad.remainder_y += dy * config.touchpad_sensitivity;
+      const int x = (int)touchpad.remainder_x;
+      const int y = (int)touchpad.remainder_y;
+      touchpad.remainder_x -= x;
+      touchpad.remainder_y -= y;
+      if (x != 0 || y != 0) {
+        emitMouseMotion(x, y);
+      }
+    } else if (touchpad.pointer_fingers == 2) {
+      // both fingers report their motion, so each adds half; swiping up scrolls up
+      touchpad.scroll_remainder -= dy / TOUCHPAD_ASPECT * config.touchpad_scroll_sensitivity / 2;
+      const int units = (int)touchpad.scroll_remainder;
+      touchpad.scroll_remainder -= units;
+      if (units != 0) {
+        emitWheel(units, 0);
+      }
+    }
+  } else if (type == SDL_CONTROLLERTOUCHPADUP) {
+    if (!finger.down) return;
+    finger.down = false;
+    if (finger.region != 0) {
+      emitKey(config.touchpad_region_key[finger.region], false, config.touchpad_region_modifier[finger.region]);
+      finger.region = 0;
+      return;
+    }
+    if (--touchpad.pointer_fingers == 0) {
+      if (config.touchpad_tap && !touchpad.gesture_moved && touch.timestamp - touchpad.gesture_start < TOUCHPAD_TAP_TIME) {
+        tapTouchpad(touchpad.gesture_fingers == 1 ? BTN_LEFT : BTN_RIGHT);
+      }
+      touchpad.remainder_x = touchpad.remainder_y = 0.0f;
+      touchpad.scroll_remainder = 0.0f;
+    }
+  }
+}
+#endif
+
+void handleAnalogTrigger(bool is_triggered, bool& was_triggered, int key, int modifier=0)
+{
+  if (is_triggered && !was_triggered) {
+    emitKey(key, true, modifier);
+  } else if (!is_triggered && was_triggered) {
+    emitKey(key, false, modifier);
+  }
+
+  was_triggered = is_triggered;
+}
+
+// L2/R2 as keys: the active layer's key if it maps the trigger, otherwise its own
+void handleTriggerKey(int layer_key, bool is_triggered, bool& was_triggered, short key, short modifier)
+{
+  if (is_triggered == was_triggered) {
+    return;
+  }
+  was_triggered = is_triggered;
+  if (!handleLayerButton(layer_key, is_triggered, layer_key)) {
+    emitKey(key, is_triggered, modifier);
+  }
+}
+
+void handleAnalogKey(bool is_triggered, bool& was_triggered, short key, short modifier, bool repeat)
+{
+  handleAnalogTrigger(is_triggered, was_triggered, key, modifier);
+  if (is_triggered && repeat && (state.key_to_repeat == 0)) {
+    setKeyRepeat(key, true);
+  } else if (!is_triggered && repeat && (state.key_to_repeat == key)) {
+    setKeyRepeat(key, false);
+  }
+}
+
+void handleAnalogStick(int directions, bool left_stick)
+{
+  struct
+  {
+    int direction;
+    bool& was_triggered;
+    short key;
+    short modifier;
+    bool repeat;
+  } keys[] = {
+    {ANALOG_DIR_UP,
+     left_stick ? state.left_analog_was_up : state.right_analog_was_up,
+     left_stick ? config.left_analog_up : config.right_analog_up,
+     left_stick ? config.left_analog_up_modifier : config.right_analog_up_modifier,
+     left_stick ? config.left_analog_up_repeat : config.right_analog_up_repeat},
+    {ANALOG_DIR_DOWN,
+     left_stick ? state.left_analog_was_down : state.right_analog_was_down,
+     left_stick ? config.left_analog_down : config.right_analog_down,
+     left_stick ? config.left_analog_down_modifier : config.right_analog_down_modifier,
+     left_stick ? config.left_analog_down_repeat : config.right_analog_down_repeat},
+    {ANALOG_DIR_LEFT,
+     left_stick ? state.left_analog_was_left : state.right_analog_was_left,
+     left_stick ? config.left_analog_left : config.right_analog_left,
+     left_stick ? config.left_analog_left_modifier : config.right_analog_left_modifier,
+     left_stick ? config.left_analog_left_repeat : config.right_analog_left_repeat},
+    {ANALOG_DIR_RIGHT,
+     left_stick ? state.left_analog_was_right : state.right_analog_was_right,
+     left_stick ? config.left_analog_right : config.right_analog_right,
+     left_stick ? config.left_analog_right_modifier : config.right_analog_right_modifier,
+     left_stick ? config.left_analog_right_repeat : config.right_analog_right_repeat},
+  };
+
+  // releases first, so moving between sectors never briefly holds both keys
+  for (auto& k : keys) {
+    if (!(directions & k.direction)) handleAnalogKey(false, k.was_triggered, k.key, k.modifier, k.repeat);
+  }
+  for (auto& k : keys) {
+    if (directions & k.direction) handleAnalogKey(true, k.was_triggered, k.key, k.modifier, k.repeat);
+  }
+}
+
+void setupFakeKeyboardMouseDevice(uinput_user_dev& device, int fd)
+{
+  strncpy(device.name, "Fake Keyboard", UINPUT_MAX_NAME_SIZE);
+  device.id.vendor = 0x1234;  /* sample vendor */
+  device.id.product = 0x5678; /* sample product */
+
+  for (int i = 0; i < 256; i++) {
+    ioctl(fd, UI_SET_KEYBIT, i);
+  }
+
+  // Keys or Buttons
+  ioctl(fd, UI_SET_EVBIT, EV_KEY);
+  ioctl(fd, UI_SET_EVBIT, EV_SYN);
+
+  // Fake mouse
+  ioctl(fd, UI_SET_EVBIT, EV_REL);
+  ioctl(fd, UI_SET_RELBIT, REL_X);
+  ioctl(fd, UI_SET_RELBIT, REL_Y);
+  ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+  ioctl(fd, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+  ioctl(fd, UI_SET_RELBIT, REL_HWHEEL);
+  ioctl(fd, UI_SET_RELBIT, REL_HWHEEL_HI_RES);
   ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
   ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+  ioctl(fd, UI_SET_KEYBIT, BTN_MIDDLE);
+  ioctl(fd, UI_SET_KEYBIT, BTN_SIDE);
+  ioctl(fd, UI_SET_KEYBIT, BTN_EXTRA);
+}
+
+void setupFakeTouchscreenDevice(uinput_user_dev& device, int fd)
+{
+  strncpy(device.name, "Fake Touchscreen", UINPUT_MAX_NAME_SIZE);
+  device.id.vendor = 0x1234;  /* sample vendor */
+  device.id.product = 0x5679; /* sample product */
+
+  if (
+    ioctl(fd, UI_SET_EVBIT, EV_KEY) || ioctl(fd, UI_SET_EVBIT, EV_SYN) ||
+    ioctl(fd, UI_SET_EVBIT, EV_ABS) ||
+    ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_X) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_Y) ||
+    ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT)) {
+    printf("Failed to configure fake touchscreen\n");
+    exit(-1);
+  }
+
+  UINPUT_SET_ABS_P(&device, ABS_X, 0, config.mouse_absolute_width - 1, 0, 0);
+  UINPUT_SET_ABS_P(&device, ABS_Y, 0, config.mouse_absolute_height - 1, 0, 0);
+}
+
+void setupFakeXbox360Device(uinput_user_dev& device, int fd)
+{
+  strncpy(device.name, "Microsoft X-Box 360 pad", UINPUT_MAX_NAME_SIZE);
+  device.id.vendor = 0x045e;  /* sample vendor */
+  device.id.product = 0x028e; /* sample product */
+
+  if (
+    ioctl(fd, UI_SET_EVBIT, EV_KEY) || ioctl(fd, UI_SET_EVBIT, EV_SYN) ||
+    ioctl(fd, UI_SET_EVBIT, EV_ABS) ||
+    // X-Box 360 pad buttons
+    ioctl(fd, UI_SET_KEYBIT, BTN_A) || ioctl(fd, UI_SET_KEYBIT, BTN_B) ||
+    ioctl(fd, UI_SET_KEYBIT, BTN_X) || ioctl(fd, UI_SET_KEYBIT, BTN_Y) ||
+    ioctl(fd, UI_SET_KEYBIT, BTN_TL) || ioctl(fd, UI_SET_KEYBIT, BTN_TR) ||
+    ioctl(fd, UI_SET_KEYBIT, BTN_THUMBL) ||
+    ioctl(fd, UI_SET_KEYBIT, BTN_THUMBR) ||
+    ioctl(fd, UI_SET_KEYBIT, BTN_SELECT) ||
+    ioctl(fd, UI_SET_KEYBIT, BTN_START) || ioctl(fd, UI_SET_KEYBIT, BTN_MODE) ||
+    // absolute (sticks)
+    ioctl(fd, UI_SET_ABSBIT, ABS_X) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_Y) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_RX) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_RY) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_Z) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_RZ) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_HAT0X) ||
+    ioctl(fd, UI_SET_ABSBIT, ABS_HAT0Y)) {
+    printf("Failed to configure fake Xbox 360 controller\n");
+    exit(-1);
+  }
+
+  UINPUT_SET_ABS_P(&device, ABS_X, -32768, 32767, 16, 128);
+  UINPUT_SET_ABS_P(&device, ABS_Y, -32768, 32767, 16, 128);
+  UINPUT_SET_ABS_P(&device, ABS_RX, -32768, 32767, 16, 128);
+  UINPUT_SET_ABS_P(&device, ABS_RY, -32768, 32767, 16, 128);
+  UINPUT_SET_ABS_P(&device, ABS_HAT0X, -1, 1, 0, 0);
+  UINPUT_SET_ABS_P(&device, ABS_HAT0Y, -1, 1, 0, 0);
+  UINPUT_SET_ABS_P(&device, ABS_Z, 0, 255, 0, 0);
+  UINPUT_SET_ABS_P(&device, ABS_RZ, 0, 255, 0, 0);
+
+  // rumble, passed through to the physical controller
+  if (ioctl(fd, UI_SET_EVBIT, EV_FF) || ioctl(fd, UI_SET_FFBIT, FF_RUMBLE)) {
+    printf("Failed to enable rumble on fake Xbox 360 controller\n");
+  } else {
+    device.ff_effects_max = FF_EFFECTS_MAX;
+  }
+}
+
+// Games upload rumble effects to the fake pad and then play them. A helper
+// thread answers the upload handshake straight away, so neither the game nor
+// our input loop ever waits on the other, and posts each play request to the
+// main loop as an SDL event carrying the effect
+struct
+{
+  Uint32 event_type = 0; // SDL user event for play requests, 0 if rumble is off
+  SDL_GameController* controller = NULL;
+  Uint64 rumble_until = 0; // main thread only; end of the rumble playing, 0 if none
+} force_feedback;
+
+int forceFeedbackThread(void*)
+{
+  struct
+  {
+    Uint16 strong;
+    Uint16 weak;
+    Uint16 length; // ms, 0 until stopped
+  } effects[FF_EFFECTS_MAX] = {};
+  struct pollfd fd = {uinp_fd, POLLIN, 0};
+
+  while (true) {
+    if (poll(&fd, 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      logMessage(LOG_ERROR, "rumble stopped: %s\n", strerror(errno));
+      return -1;
+    }
+
+    struct input_event ev;
+    while (read(uinp_fd, &ev, sizeof(ev)) == sizeof(ev)) {
+      if (ev.type == EV_UINPUT && ev.code == UI_FF_UPLOAD) {
+        struct uinput_ff_upload upload;
+        memset(&upload, 0, sizeof(upload));
+        upload.request_id = ev.value;
+        if (ioctl(uinp_fd, UI_BEGIN_FF_UPLOAD, &upload) < 0) continue;
+        if (upload.effect.type == FF_RUMBLE && upload.effect.id >= 0 && upload.effect.id < FF_EFFECTS_MAX) {
+          effects[upload.effect.id].strong = upload.effect.u.rumble.strong_magnitude;
+          effects[upload.effect.id].weak = upload.effect.u.rumble.weak_magnitude;
+          effects[upload.effect.id].length = upload.effect.replay.length;
+          upload.retval = 0;
+        } else {
+          upload.retval = -EINVAL;
+        }
+        ioctl(uinp_fd, UI_END_FF_UPLOAD, &upload);
+      } else if (ev.type == EV_UINPUT && ev.code == UI_FF_ERASE) {
+        struct uinput_ff_erase erase;
+        memset(&erase, 0, sizeof(erase));
+        erase.request_id = ev.value;
+        if (ioctl(uinp_fd, UI_BEGIN_FF_ERASE, &erase) < 0) continue;
+        if (erase.effect_id < FF_EFFECTS_MAX) {
+          effects[erase.effect_id].strong = effects[erase.effect_id].weak = effects[erase.effect_id].length = 0;
+        }
+        erase.retval = 0;
+        ioctl(uinp_fd, UI_END_FF_ERASE, &erase);
+      } else if (ev.type == EV_FF && ev.code < FF_EFFECTS_MAX) {
+        SDL_Event event;
+        memset(&event, 0, sizeof(event));
+        event.type = force_feedback.event_type;
+        event.user.code = ev.value; // times to play, 0 to stop
+        event.user.data1 = (void*)(intptr_t)((effects[ev.code].strong << 16) | effects[ev.code].weak);
+        event.user.data2 = (void*)(intptr_t)effects[ev.code].length;
+        SDL_PushEvent(&event);
+        wakeMainLoop();
+      }
+    }
+  }
+}
+
+void playRumble(const SDL_UserEvent& request)
+{
+  if (force_feedback.controller == NULL) {
+    return;
+  }
+  if (request.code <= 0) {
+    SDL_GameControllerRumble(force_feedback.controller, 0, 0, 0);
+    force_feedback.rumble_until = 0;
+    return;
+  }
+  const Uint32 magnitudes = (Uint32)(intptr_t)request.data1;
+  const Uint32 length = (Uint32)(intptr_t)request.data2;
+  // SDL caps the duration itself; 0 rumbles until the game stops the effect
+  const Uint32 duration = length * (request.code < 0xffff ? request.code : 0xffff);
+  SDL_GameControllerRumble(force_feedback.controller, magnitudes >> 16, magnitudes & 0xffff, duration);
+  const Uint32 capped = duration == 0 || duration > 0xffff ? 0xffff : duration;
+  force_feedback.rumble_until = monotonicTimeUs() + capped * 1000ULL + POWER_RUMBLE_POLL_US;
+}
+
+// SDL stops a timed rumble, and refreshes it for some controllers, while pumping
+// events, so keep waking now and then while one is playing
+Uint64 nextRumbleDeadline(Uint64 now)
+{
+  if (force_feedback.rumble_until <= now) {
+    force_feedback.rumble_until = 0;
+    return 0;
+  }
+  return earliestDeadline(force_feedback.rumble_until, now + POWER_RUMBLE_POLL_US);
+}
+
+#define SHARED_STATE_MAGIC 0x4b545047 // "GPTK"
+#define SHARED_STATE_VERSION 1
+#define SHARED_STATE_CONTROLLERS 4
+
+// Snapshot published for overlays and launchers that want the pad state
+// without opening the controller themselves. The layout is fixed per
+// SHARED_STATE_VERSION; readers copy it out while seq is even and unchanged
+// before and after the copy (a seqlock), and retry otherwise
+struct shared_controller
+{
+  Sint32 instance_id; // SDL joystick instance id, -1 if the slot is unused
+  Uint32 buttons; // bit n is set while SDL_GameControllerButton n is held
+  Sint16 axes[SDL_CONTROLLER_AXIS_MAX]; // raw SDL axis values
+  Uint16 padding;
+};
+
+struct shared_state_layout
+{
+  Uint32 magic;
+  Uint32 version;
+  Uint32 size; // sizeof(shared_state_layout)
+  Uint32 seq; // odd while an update is being written
+  Uint64 updated_us; // CLOCK_MONOTONIC time of the last update
+  Uint32 active_layer; // layer selected by the held chord buttons, 0 for none, LAYER_HOTKEY for the hotkey
+  Uint32 controller_count; // slots in use
+  shared_controller controllers[SHARED_STATE_CONTROLLERS];
+};
+
+struct
+{
+  const char* path = NULL; // set with -state or GPTOKEYB_STATE to publish
+  shared_state_layout* mapped = NULL;
+  shared_state_layout current; // built up while a batch is handled; everything from updated_us on is copied out once per batch
+  bool changed = false;
+} shared_state;
+
+void openSharedState()
+{
+  int fd = open(shared_state.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(shared_state_layout)) != 0) {
+    printf("Unable to create controller state file %s\n", shared_state.path);
+    if (fd >= 0) close(fd);
+    return;
+  }
+  void* mapped = mmap(NULL, sizeof(shared_state_layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    printf("Unable to map controller state file %s\n", shared_state.path);
+    return;
+  }
+
+  memset(&shared_state.current, 0, sizeof(shared_state.current));
+  for (auto& controller : shared_state.current.controllers) {
+    controller.instance_id = -1;
+  }
+  shared_state.mapped = (shared_state_layout*)mapped;
+  shared_state.mapped->magic = SHARED_STATE_MAGIC;
+  shared_state.mapped->version = SHARED_STATE_VERSION;
+  shared_state.mapped->size = sizeof(shared_state_layout);
+  shared_state.changed = true;
+  printf("Publishing controller state in %s\n", shared_state.path);
+}
+
+shared_controller* sharedController(SDL_JoystickID instance_id, bool add)
+{
+  shared_controller* free_slot = NULL;
+  for (auto& controller : shared_state.current.controllers) {
+    if (controller.instance_id == instance_id) return &controller;
+    if (controller.instance_id == -1 && free_slot == NULL) free_slot = &controller;
+  }
+  if (add && free_slot != NULL) {
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->instance_id = instance_id;
+    shared_state.current.controller_count++;
+  }
+  return add ? free_slot : NULL;
+}
+
+// Called for every SDL event before it is mapped; only touches process memory
+void recordSharedState(const SDL_Event& event)
+{
+  if (shared_state.mapped == NULL) {
+    return;
+  }
+  shared_controller* controller;
+  switch (event.type) {
+    case SDL_CONTROLLERBUTTONDOWN:
+    case SDL_CONTROLLERBUTTONUP:
+      if ((controller = sharedController(event.cbutton.which, true)) && event.cbutton.button < 32) {
+        if (event.type == SDL_CONTROLLERBUTTONDOWN) {
+          controller->buttons |= 1u << event.cbutton.button;
+        } else {
+          controller->buttons &= ~(1u << event.cbutton.button);
+        }
+        shared_state.changed = true;
+      }
+      break;
+
+    case SDL_CONTROLLERAXISMOTION:
+      if ((controller = sharedController(event.caxis.which, true)) && event.caxis.axis < SDL_CONTROLLER_AXIS_MAX) {
+        controller->axes[event.caxis.axis] = event.caxis.value;
+        shared_state.changed = true;
+      }
+      break;
+
+    case SDL_CONTROLLERDEVICEREMOVED:
+      if ((controller = sharedController(event.cdevice.which, false))) {
+        controller->instance_id = -1;
+        shared_state.current.controller_count--;
+        shared_state.changed = true;
+      }
+      break;
+  }
+}
+
+// Copy the snapshot out once per processed batch
+void publishSharedState()
+{
+  if (shared_state.mapped == NULL) {
+    return;
+  }
+  const Uint32 active_layer = layers.active_layer[layers.held];
+  if (!shared_state.changed && active_layer == shared_state.current.active_layer) {
+    return;
+  }
+  shared_state.current.active_layer = active_layer;
+  shared_state.current.updated_us = monotonicTimeUs();
+
+  shared_state_layout* mapped = shared_state.mapped;
+  const Uint32 seq = shared_state.current.seq + 1;
+  __atomic_store_n(&mapped->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  const size_t body = offsetof(shared_state_layout, updated_us);
+  memcpy((char*)mapped + body, (const char*)&shared_state.current + body, sizeof(shared_state_layout) - body);
+  __atomic_store_n(&mapped->seq, seq + 1, __ATOMIC_RELEASE);
+  shared_state.current.seq = seq + 1;
+  shared_state.changed = false;
+}
+
+void countInput(Uint32 type)
+{
+  int kind = STATS_INPUT_OTHER;
+  switch (type) {
+    case SDL_CONTROLLERBUTTONDOWN:
+    case SDL_CONTROLLERBUTTONUP:
+      kind = STATS_INPUT_BUTTON;
+      break;
+    case SDL_CONTROLLERAXISMOTION:
+      kind = STATS_INPUT_AXIS;
+      break;
+    case SDL_CONTROLLERDEVICEADDED:
+    case SDL_CONTROLLERDEVICEREMOVED:
+    case SDL_CONTROLLERDEVICEREMAPPED:
+      kind = STATS_INPUT_DEVICE;
+      break;
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+    case SDL_CONTROLLERTOUCHPADDOWN:
+    case SDL_CONTROLLERTOUCHPADMOTION:
+    case SDL_CONTROLLERTOUCHPADUP:
+      kind = STATS_INPUT_TOUCHPAD;
+      break;
+    case SDL_CONTROLLERSENSORUPDATE:
+      kind = STATS_INPUT_SENSOR;
+      break;
+#endif
+  }
+  stats.counters.input_events[kind]++;
+}
+
+int timerQueueDepth()
+{
+  int depth = state.key_to_repeat != 0 ? 1 : 0;
+  for (const auto& run : running_macros) {
+    if (run.macro != 0) depth++;
+  }
+  for (const auto& role : dual_roles) {
+    if (role.state == DUAL_ROLE_PENDING || role.state == DUAL_ROLE_TAP) depth++;
+  }
+  for (int button = 0; button < SDL_CONTROLLER_BUTTON_MAX; button++) {
+    if (turbo.held[button]) depth++;
+  }
+  if (touchpad.click_button != 0) depth++;
+  if (mouseMoving()) depth++;
+  if (nextTextStreamDeadline() != 0) depth++;
+  return depth;
+}
+
+void takeStatsSnapshot()
+{
+  stats.snapshot = stats.counters;
+  stats.snapshot.timer_depth = timerQueueDepth();
+  stats.snapshot.uptime_us = monotonicTimeUs() - stats.started_us;
+  stats.snapshot.latency_samples = realtime.latency_samples;
+  stats.snapshot.latency_total_us = realtime.latency_total_us;
+  stats.snapshot.latency_max_us = realtime.latency_max_us;
+  stats.snapshot.allocations = realtime.allocations;
+  SDL_SemPost(stats.ready);
 }
 
-void setupFakeXbox360Device(uinput_user_dev& device, int fd)
+void writeStats(const stats_counters& c, const stats_counters& previous)
 {
-  strncpy(device.name, "Microsoft X-Box 360 pad", UINPUT_MAX_NAME_SIZE);
-  device.id.vendor = 0x045e;  /* sample vendor */
-  device.id.product = 0x028e; /* sample product */
+  const double uptime = c.uptime_us / 1000000.0;
+  const double interval = (c.uptime_us - previous.uptime_us) / 1000000.0;
+  char text[1024];
+  const int length = snprintf(text, sizeof(text),
+    "uptime_s %.1f\n"
+    "input_button %lu\ninput_axis %lu\ninput_device %lu\ninput_touchpad %lu\ninput_sensor %lu\ninput_other %lu\n"
+    "output_events %lu\nwrites %lu\nshort_writes %lu\nfailed_writes %lu\n"
+    "wakeups %lu\nwakeups_per_min %.1f\nmouse_ticks %lu\nrepeats %lu\ntimer_depth %d\n"
+    "latency_avg_us %llu\nlatency_max_us %llu\nheap_allocations %lu\n",
+    uptime,
+    c.input_events[STATS_INPUT_BUTTON], c.input_events[STATS_INPUT_AXIS], c.input_events[STATS_INPUT_DEVICE],
+    c.input_events[STATS_INPUT_TOUCHPAD], c.input_events[STATS_INPUT_SENSOR], c.input_events[STATS_INPUT_OTHER],
+    c.output_events, c.writes, c.short_writes, c.failed_writes,
+    c.wakeups, interval > 0 ? (c.wakeups - previous.wakeups) * 60 / interval : 0.0, c.mouse_ticks, c.repeats, c.timer_depth,
+    (unsigned long long)(c.latency_samples ? c.latency_total_us / c.latency_samples : 0),
+    (unsigned long long)c.latency_max_us, c.allocations);
+
+  if (stats.path == NULL) {
+    // one line at a time, as a log record is shorter than the whole text
+    char* saved;
+    for (char* line = strtok_r(text, "\n", &saved); line != NULL; line = strtok_r(NULL, "\n", &saved)) {
+      logMessage(LOG_INFO, "stats: %s\n", line);
+    }
+    return;
+  }
+  // write the whole file and rename it into place, so readers never see half of it
+  char temp_path[PATH_MAX];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", stats.path);
+  const int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    logMessage(LOG_WARN, "Unable to write stats to %s\n", stats.path);
+    return;
+  }
+  const bool written = write(fd, text, length) == length;
+  close(fd);
+  if (!written || rename(temp_path, stats.path) != 0) {
+    logMessage(LOG_WARN, "Unable to write stats to %s\n", stats.path);
+  }
+}
 
-  if (
-    ioctl(fd, UI_SET_EVBIT, EV_KEY) || ioctl(fd, UI_SET_EVBIT, EV_SYN) ||
-    ioctl(fd, UI_SET_EVBIT, EV_ABS) ||
-    // X-Box 360 pad buttons
-    ioctl(fd, UI_SET_KEYBIT, BTN_A) || ioctl(fd, UI_SET_KEYBIT, BTN_B) ||
-    ioctl(fd, UI_SET_KEYBIT, BTN_X) || ioctl(fd, UI_SET_KEYBIT, BTN_Y) ||
-    ioctl(fd, UI_SET_KEYBIT, BTN_TL) || ioctl(fd, UI_SET_KEYBIT, BTN_TR) ||
-    ioctl(fd, UI_SET_KEYBIT, BTN_THUMBL) ||
-    ioctl(fd, UI_SET_KEYBIT, BTN_THUMBR) ||
-    ioctl(fd, UI_SET_KEYBIT, BTN_SELECT) ||
-    ioctl(fd, UI_SET_KEYBIT, BTN_START) || ioctl(fd, UI_SET_KEYBIT, BTN_MODE) ||
-    // absolute (sticks)
-    ioctl(fd, UI_SET_ABSBIT, ABS_X) ||
-    ioctl(fd, UI_SET_ABSBIT, ABS_Y) ||
-    ioctl(fd, UI_SET_ABSBIT, ABS_RX) ||
-    ioctl(fd, UI_SET_ABSBIT, ABS_RY) ||
-    ioctl(fd, UI_SET_ABSBIT, ABS_Z) ||
-    ioctl(fd, UI_SET_ABSBIT, ABS_RZ) ||
-    ioctl(fd, UI_SET_ABSBIT, ABS_HAT0X) ||
-    ioctl(fd, UI_SET_ABSBIT, ABS_HAT0Y)) {
-    printf("Failed to configure fake Xbox 360 controller\n");
-    exit(-1);
+int statsThread(void*)
+{
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  stats_counters previous = {};
+  int signal;
+  while (sigwait(&signals, &signal) == 0) {
+    SDL_Event event;
+    memset(&event, 0, sizeof(event));
+    event.type = stats.event_type;
+    if (SDL_PushEvent(&event) <= 0) continue;
+    wakeMainLoop();
+    SDL_SemWait(stats.ready);
+    writeStats(stats.snapshot, previous);
+    previous = stats.snapshot;
   }
+  return 0;
+}
 
-  UINPUT_SET_ABS_P(&device, ABS_X, -32768, 32767, 16, 128);
-  UINPUT_SET_ABS_P(&device, ABS_Y, -32768, 32767, 16, 128);
-  UINPUT_SET_ABS_P(&device, ABS_RX, -32768, 32767, 16, 128);
-  UINPUT_SET_ABS_P(&device, ABS_RY, -32768, 32767, 16, 128);
-  UINPUT_SET_ABS_P(&device, ABS_HAT0X, -1, 1, 0, 0);
-  UINPUT_SET_ABS_P(&device, ABS_HAT0Y, -1, 1, 0, 0);
-  UINPUT_SET_ABS_P(&device, ABS_Z, 0, 255, 0, 0);
-  UINPUT_SET_ABS_P(&device, ABS_RZ, 0, 255, 0, 0);
+void startStats()
+{
+  stats.started_us = monotonicTimeUs();
+  stats.event_type = SDL_RegisterEvents(1);
+  stats.ready = SDL_CreateSemaphore(0);
+  if (stats.event_type == (Uint32)-1 || stats.ready == NULL) {
+    stats.event_type = 0;
+    return;
+  }
+  if (SDL_Thread* thread = SDL_CreateThread(statsThread, "stats", NULL)) {
+    SDL_DetachThread(thread);
+  } else {
+    stats.event_type = 0;
+  }
+}
+
+// START combinations in config mode: with the hotkey it ends the game in kill
+// mode, and with the D-pad it triggers the text input modes
+void handleStartCombos()
+{
+  if ((kill_mode) && (state.start_pressed && state.hotkey_pressed)) {
+    if (pckill_mode) {
+      emitKey(KEY_F4,true,MODIFIER_ALT);
+      flushAndDelay(15);
+      emitKey(KEY_F4,false,MODIFIER_ALT);
+    }
+    releaseAllKeys();
+    if (! sudo_kill) {
+       // printf("Killing: %s\n", AppToKill);
+       if (state.start_jsdevice == state.hotkey_jsdevice) {
+          char buffer[128];
+          sprintf(buffer, "killall -%d '%s' ", kill_signal, AppToKill);
+          logMessage(LOG_INFO, "%s\n", buffer);
+          system(buffer);
+          sleep(3);
+          if (system((" pgrep '" + std::string(AppToKill) + "' ").c_str()) == 0) {
+              logMessage(LOG_WARN, "Forcefully Killing: %s\n", AppToKill);
+              system((" killall  -9 '" + std::string(AppToKill) + "' ").c_str());
+          }
+          exit(0);
+       }
+    } else {
+       if (state.start_jsdevice == state.hotkey_jsdevice) {
+         system((" kill -9 $(pidof '" + std::string(AppToKill) + "') ").c_str());
+         sleep(3);
+         exit(0);
+       }
+     } // sudo kill
+  } //kill mode 
+  else if ((textinputpreset_mode) && (state.textinputpresettrigger_pressed && state.start_pressed)) { //activate input preset mode - send predefined text as a series of keystrokes
+      logMessage(LOG_INFO, "text input preset pressed\n");
+      state.start_combo_triggered = true;
+      if (state.start_jsdevice == state.textinputpresettrigger_jsdevice) {
+          if (config.text_input_preset != NULL) {
+              logMessage(LOG_INFO, "text input processing %s\n", config.text_input_preset);
+              processKeys();
+          }
+      }
+      state.textinputpresettrigger_pressed = false; //reset textinputpreset trigger
+      state.start_pressed = false;
+      state.start_jsdevice = 0;
+      state.textinputpresettrigger_jsdevice = 0;
+   } //input preset trigger mode (i.e. not kill mode)
+  else if ((textinputpreset_mode) && (state.textinputconfirmtrigger_pressed && state.start_pressed)) { //activate input preset confirm mode - send ENTER key
+      logMessage(LOG_INFO, "text input confirm pressed\n");
+      state.start_combo_triggered = true;
+      if (state.start_jsdevice == state.textinputconfirmtrigger_jsdevice) {
+          logMessage(LOG_INFO, "text input Enter key\n");
+          emitKey(char_to_keycode("enter"), true);
+          flushAndDelay(15);
+          emitKey(char_to_keycode("enter"), false);
+      }
+      state.textinputconfirmtrigger_pressed = false; //reset textinputpreset confirm trigger
+      state.start_pressed = false;
+      state.start_jsdevice = 0;
+      state.textinputconfirmtrigger_jsdevice = 0;
+    } //input confirm trigger mode (i.e. not kill mode)         
+  else if ((textinputinteractive_mode) && (state.textinputinteractivetrigger_pressed && state.start_pressed)) { //activate interactive text input mode
+      logMessage(LOG_INFO, "text input interactive pressed\n");
+      state.start_combo_triggered = true;
+      if (state.start_jsdevice == state.textinputinteractivetrigger_jsdevice) {
+          logMessage(LOG_INFO, "text input interactive mode active\n");
+          state.textinputinteractive_mode_active = true;
+          releaseAllKeys(); // also disables any active key repeat timer
+          current_character = 0;
+
+          if (textinputinteractive_daisywheel) {
+            daisywheel.group = -1;
+            daisywheel.typed = 0;
+            daisywheel.capitals = daisywheel.symbols = false;
+          } else {
+            predictTextInputKey();
+            addTextInputCharacter();
+          }
+      }
+      state.textinputinteractivetrigger_pressed = false; //reset interactive text input mode trigger
+      state.start_pressed = false;
+      state.textinputinteractivetrigger_jsdevice = 0;
+      state.start_jsdevice = 0;
+    } //input interactive trigger mode (i.e. not kill mode)
 }
 
 bool handleEvent(const SDL_Event& event)
 {
 SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.which);
+  recordSharedState(event);
+  recordInput(event);
+  countInput(event.type);
   switch (event.type) {
     case SDL_CONTROLLERBUTTONDOWN:
     case SDL_CONTROLLERBUTTONUP: {
       const bool is_pressed = event.type == SDL_CONTROLLERBUTTONDOWN;
+      const bool mapping = !state.textinputinteractive_mode_active && !xbox360_mode;
+      // the button as far as layers and the hotkey go, INVALID for a GUIDE that doubles BACK
+      int layer_button = event.cbutton.button;
+      if (mapping && (layer_button == SDL_CONTROLLER_BUTTON_BACK || layer_button == SDL_CONTROLLER_BUTTON_GUIDE) && backIsHotkey(controller)) {
+        layer_button = layer_button == SDL_CONTROLLER_BUTTON_BACK ? SDL_CONTROLLER_BUTTON_GUIDE : SDL_CONTROLLER_BUTTON_INVALID;
+      }
+      if (mapping && layer_button == hotkey_button) {
+        state.hotkey_jsdevice = event.cdevice.which;
+        state.hotkey_pressed = is_pressed;
+      }
 
-        if (state.textinputinteractive_mode_active) {
+        if (state.textinputinteractive_mode_active && textinputinteractive_daisywheel) {
+          handleDaisywheelButton(event.cbutton.button, is_pressed);
+        } else if (state.textinputinteractive_mode_active) {
         switch (event.cbutton.button) {
           case SDL_CONTROLLER_BUTTON_DPAD_LEFT: //move back one character
             if (is_pressed) {
@@ -1471,17 +4705,19 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
             
           case SDL_CONTROLLER_BUTTON_DPAD_RIGHT: //add one more character
             if (is_pressed) {
-              if ((character_set[current_key[current_character]] == KEY_SPACE) && (!(textinputinteractive_noautocapitals))) {
+              if ((character_set[current_key[current_character]].code == KEY_SPACE) && (!(textinputinteractive_noautocapitals))) {
                 current_key[++current_character] = 0; // use capitals after a space
               } else {
                 current_character++;
               }
               if (current_character < maxChars) {
+                predictTextInputKey();
                 addTextInputCharacter();
               } else { // reached limit of characters
                 confirmTextInputCharacter();
                 state.textinputinteractive_mode_active = false;
-                printf("text input interactive mode no longer active\n");
+                releaseAllKeys();
+                logMessage(LOG_INFO, "text input interactive mode no longer active\n");
               }
             }
             break; //SDL_CONTROLLER_BUTTON_DPAD_RIGHT
@@ -1513,9 +4749,11 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
             }
             break; //SDL_CONTROLLER_BUTTON_LEFTSHOULDER
             
-          case SDL_CONTROLLER_BUTTON_RIGHTSHOULDER:  //jump forward by 13 letters
+          case SDL_CONTROLLER_BUTTON_RIGHTSHOULDER:  //complete the word from the dictionary, or jump forward by 13 letters
             if (is_pressed) {
-                nextTextInputKey(false); //jump forward by 13 letters
+                if (!acceptTextInputSuggestion()) {
+                  nextTextInputKey(false); //jump forward by 13 letters
+                }
                 setInputRepeat(KEY_DOWN, false); //disable key repeat        
             } else {
                 setInputRepeat(KEY_DOWN, false);
@@ -1527,7 +4765,8 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
               confirmTextInputCharacter();
               //disable interactive mode
               state.textinputinteractive_mode_active = false;
-              printf("text input interactive mode no longer active\n");
+              releaseAllKeys();
+              logMessage(LOG_INFO, "text input interactive mode no longer active\n");
             }
             break; //SDL_CONTROLLER_BUTTON_A
 
@@ -1536,13 +4775,14 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
             if (is_pressed) { // cancel key input and disable interactive input mode
               for( int ii = 0; ii <= current_character; ii++ ) {
                 removeTextInputCharacter(); // delete all characters
-                if ((character_set[current_key[current_character]] == KEY_SPACE) && app_exult_adjust) {
+                if ((character_set[current_key[current_character]].code == KEY_SPACE) && app_exult_adjust) {
                   removeTextInputCharacter(); //remove extra spaces            
                 }
               }
               initialiseCharacters(); //reset the character selections ready for new text to be added later
               state.textinputinteractive_mode_active = false;
-              printf("text input interactive mode no longer active\n");
+              releaseAllKeys();
+              logMessage(LOG_INFO, "text input interactive mode no longer active\n");
             }
             break; //SDL_CONTROLLER_BUTTON_BACK
             
@@ -1551,7 +4791,8 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
               confirmTextInputCharacter(); // send ENTER key to confirm text entry
               //disable interactive mode
               state.textinputinteractive_mode_active = false;
-              printf("text input interactive mode no longer active\n");
+              releaseAllKeys();
+              logMessage(LOG_INFO, "text input interactive mode no longer active\n");
             }
             break; //SDL_CONTROLLER_BUTTON_START
             
@@ -1639,20 +4880,21 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
         }
          if ((kill_mode) && (state.start_pressed && state.hotkey_pressed)) {      
           if (pckill_mode) {
-            emitKey(KEY_F4,true,KEY_LEFTALT);
-            SDL_Delay(15);
-            emitKey(KEY_F4,false,KEY_LEFTALT);
+            emitKey(KEY_F4,true,MODIFIER_ALT);
+            flushAndDelay(15);
+            emitKey(KEY_F4,false,MODIFIER_ALT);
           }
+          releaseAllKeys();
           if (! sudo_kill) {
              // printf("Killing: %s\n", AppToKill);
              if (state.start_jsdevice == state.hotkey_jsdevice) {
                 char buffer[128];
                 sprintf(buffer, "killall -%d '%s' ", kill_signal, AppToKill);
-                std::cout << buffer << std::endl;
+                logMessage(LOG_INFO, "%s\n", buffer);
                 system(buffer);
                 sleep(3);
                 if (system((" pgrep '" + std::string(AppToKill) + "' ").c_str()) == 0) {
-                    printf("Forcefully Killing: %s\n", AppToKill);
+                    logMessage(LOG_WARN, "Forcefully Killing: %s\n", AppToKill);
                     system((" killall  -9 '" + std::string(AppToKill) + "' ").c_str());
                 }
                 exit(0);
@@ -1666,6 +4908,21 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
            } // sudo kill
         } //kill mode
       // xbox360 mode
+      } else if (layer_button == SDL_CONTROLLER_BUTTON_INVALID) {
+        // handled through the BACK event of the same button
+      } else if (config.gyro_mouse && (event.cbutton.button == config.gyro_button)) {
+        gyro.button_held = is_pressed; // the gyro only steers the mouse while this is held
+      } else if (handleLayerButton(layer_button, is_pressed, event.cbutton.button)) {
+        // sent (or held back) by a layer
+      } else if ((event.cbutton.button < SDL_CONTROLLER_BUTTON_MAX) && (config.button_hold[event.cbutton.button] != 0)) {
+        handleDualRole(event.cbutton.button, is_pressed);
+      } else if ((event.cbutton.button < SDL_CONTROLLER_BUTTON_MAX) && (config.button_turbo[event.cbutton.button] != 0)) {
+        handleTurbo(event.cbutton.button, is_pressed);
+      } else if ((event.cbutton.button < SDL_CONTROLLER_BUTTON_MAX) && (config.button_macro[event.cbutton.button] != 0)) {
+        // a macro replaces the button's key mapping and runs from the main loop
+        if (is_pressed) {
+          startMacro(config.button_macro[event.cbutton.button]);
+        }
       } else { //config mode (i.e. not textinputinteractive_mode_active)
         switch (event.cbutton.button) {
           case SDL_CONTROLLER_BUTTON_DPAD_LEFT:
@@ -1712,154 +4969,51 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
             break;
 
           case SDL_CONTROLLER_BUTTON_A:
-            if (state.hotkey_pressed) {
-              emitKey(config.a_hk, is_pressed, config.a_hk_modifier);
-              if (is_pressed) { //keep track of combo button press so it can be released if hotkey is released before this button is released
-                state.a_hk_was_pressed = true;
-                state.hotkey_combo_triggered = true;
-              } else {
-                state.a_hk_was_pressed = false;
-              }
-            } else if (state.a_hk_was_pressed && !(is_pressed)) {
-              emitKey(config.a_hk, is_pressed, config.a_hk_modifier);              
-              state.a_hk_was_pressed = false;
-            } else {
-              emitKey(config.a, is_pressed, config.a_modifier);
-              if ((config.a_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.a))){
-                  setKeyRepeat(config.a, is_pressed);
-              }
+            emitKey(config.a, is_pressed, config.a_modifier);
+            if ((config.a_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.a))){
+                setKeyRepeat(config.a, is_pressed);
             }
             break;
 
           case SDL_CONTROLLER_BUTTON_B:
-            if (state.hotkey_pressed) {
-              emitKey(config.b_hk, is_pressed, config.b_hk_modifier);
-              if (is_pressed) { //keep track of combo button press so it can be released if hotkey is released before this button is released
-                state.b_hk_was_pressed = true;
-                state.hotkey_combo_triggered = true;
-              } else {
-                state.b_hk_was_pressed = false;
-              }
-            } else if (state.b_hk_was_pressed && !(is_pressed)) {
-              emitKey(config.b_hk, is_pressed, config.b_hk_modifier);              
-              state.b_hk_was_pressed = false;
-            } else {
-              emitKey(config.b, is_pressed, config.b_modifier);
-              if ((config.b_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.b))){
-                  setKeyRepeat(config.b, is_pressed);
-              }
+            emitKey(config.b, is_pressed, config.b_modifier);
+            if ((config.b_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.b))){
+                setKeyRepeat(config.b, is_pressed);
             }
             break;
 
           case SDL_CONTROLLER_BUTTON_X:
-            if (state.hotkey_pressed) {
-              emitKey(config.x_hk, is_pressed, config.x_hk_modifier);
-              if (is_pressed) { //keep track of combo button press so it can be released if hotkey is released before this button is released
-                state.x_hk_was_pressed = true;
-                state.hotkey_combo_triggered = true;
-              } else {
-                state.x_hk_was_pressed = false;
-              }
-            } else if (state.x_hk_was_pressed && !(is_pressed)) {
-              emitKey(config.x_hk, is_pressed, config.x_hk_modifier);              
-              state.x_hk_was_pressed = false;
-            } else {
-              emitKey(config.x, is_pressed, config.x_modifier);
-              if ((config.x_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.x))){
-                  setKeyRepeat(config.x, is_pressed);
-              }
+            emitKey(config.x, is_pressed, config.x_modifier);
+            if ((config.x_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.x))){
+                setKeyRepeat(config.x, is_pressed);
             }
             break;
 
           case SDL_CONTROLLER_BUTTON_Y:
-            if (state.hotkey_pressed) {
-              emitKey(config.y_hk, is_pressed, config.y_hk_modifier);
-              if (is_pressed) { //keep track of combo button press so it can be released if hotkey is released before this button is released
-                state.y_hk_was_pressed = true;
-                state.hotkey_combo_triggered = true;
-              } else {
-                state.y_hk_was_pressed = false;
-              }
-            } else if (state.y_hk_was_pressed && !(is_pressed)) {
-              emitKey(config.y_hk, is_pressed, config.y_hk_modifier);              
-              state.y_hk_was_pressed = false;
-            } else {
-              emitKey(config.y, is_pressed, config.y_modifier);
-              if ((config.y_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.y))){
-                  setKeyRepeat(config.y, is_pressed);
-              }
+            emitKey(config.y, is_pressed, config.y_modifier);
+            if ((config.y_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.y))){
+                setKeyRepeat(config.y, is_pressed);
             }
             break;
 
           case SDL_CONTROLLER_BUTTON_LEFTSHOULDER:
-            if (state.hotkey_pressed) {
-              emitKey(config.l1_hk, is_pressed, config.l1_hk_modifier);
-              if (is_pressed) { //keep track of combo button press so it can be released if hotkey is released before this button is released
-                state.l1_hk_was_pressed = true;
-                state.hotkey_combo_triggered = true;
-              } else {
-                state.l1_hk_was_pressed = false;
-              }
-            } else if (state.l1_hk_was_pressed && !(is_pressed)) {
-              emitKey(config.l1_hk, is_pressed, config.l1_hk_modifier);              
-              state.l1_hk_was_pressed = false;
-            } else {
-              emitKey(config.l1, is_pressed, config.l1_modifier);
-              if ((config.l1_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.l1))){
-                  setKeyRepeat(config.l1, is_pressed);
-              }
+            emitKey(config.l1, is_pressed, config.l1_modifier);
+            if ((config.l1_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.l1))){
+                setKeyRepeat(config.l1, is_pressed);
             }
             break;
 
           case SDL_CONTROLLER_BUTTON_RIGHTSHOULDER:
-            if (state.hotkey_pressed) {
-              emitKey(config.r1_hk, is_pressed, config.r1_hk_modifier);
-              if (is_pressed) { //keep track of combo button press so it can be released if hotkey is released before this button is released
-                state.r1_hk_was_pressed = true;
-                state.hotkey_combo_triggered = true;
-              } else {
-                state.r1_hk_was_pressed = false;
-              }
-            } else if (state.r1_hk_was_pressed && !(is_pressed)) {
-              emitKey(config.r1_hk, is_pressed, config.r1_hk_modifier);              
-              state.r1_hk_was_pressed = false;
-            } else {
-              emitKey(config.r1, is_pressed, config.r1_modifier);
-              if ((config.r1_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.r1))){
-                  setKeyRepeat(config.r1, is_pressed);
-              }
+            emitKey(config.r1, is_pressed, config.r1_modifier);
+            if ((config.r1_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.r1))){
+                setKeyRepeat(config.r1, is_pressed);
             }
             break;
 
           case SDL_CONTROLLER_BUTTON_LEFTSTICK:
-            if ((kill_mode && hotkey_override && (strcmp(hotkey_code, "l3") == 0)) || (textinputpreset_mode && hotkey_override && (strcmp(hotkey_code, "l3") == 0)) || (textinputinteractive_mode && hotkey_override && (strcmp(hotkey_code, "l3") == 0))) {
-                state.hotkey_jsdevice = event.cdevice.which;
-                state.hotkey_pressed = is_pressed;
-            } else if (hotkey_override && (strcmp(hotkey_code, "l3") == 0)) {
-                state.hotkey_jsdevice = event.cdevice.which;
-                state.hotkey_pressed = is_pressed;            
-            }
-            if (state.hotkey_pressed && (state.hotkey_jsdevice == event.cdevice.which)) {
-              state.hotkey_was_pressed = true; // if hotkey is pressed, note the details of hotkey press in case it is released without triggering a hotkey combo event, since its press will need to be processed
-              
-            } else if (state.hotkey_combo_triggered && !(is_pressed)) { 
-              state.hotkey_combo_triggered = false; //hotkey combo was pressed; ignore hotkey button release
-              state.hotkey_was_pressed = false; //reset hotkey
-            } else if (state.hotkey_was_pressed && !(is_pressed)) { 
-              state.hotkey_was_pressed = false;
-              emitKey(config.l3, true, config.l3_modifier); //key pressed and now released without hotkey trigger so process key press then key release
-              SDL_Delay(16);
-              emitKey(config.l3, is_pressed, config.l3_modifier);            
-              if ((config.l3_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.l3))){
-                setKeyRepeat(config.l3, is_pressed);
-                //note: hotkey cannot be assigned for key repeat; release key repeat for completeness
-              }
-            } //hotkey state check prior to emitting key, to avoid conflicts with emitkey and hotkey press        
-              else {
-              emitKey(config.l3, is_pressed, config.l3_modifier);            
-              if ((config.l3_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.l3))){
+            emitKey(config.l3, is_pressed, config.l3_modifier);
+            if ((config.l3_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.l3))){
                 setKeyRepeat(config.l3, is_pressed);
-              }
             }
             break;
 
@@ -1871,70 +5025,16 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
             break;
 
           case SDL_CONTROLLER_BUTTON_GUIDE:
-            if ((kill_mode && !(hotkey_override)) || (kill_mode && hotkey_override && (strcmp(hotkey_code, "guide") == 0)) || (textinputpreset_mode && !(hotkey_override)) || (textinputpreset_mode && (strcmp(hotkey_code, "guide") == 0)) || (textinputinteractive_mode && !(hotkey_override)) || (textinputinteractive_mode && (strcmp(hotkey_code, "guide") == 0))) {
-              state.hotkey_jsdevice = event.cdevice.which;
-              state.hotkey_pressed = is_pressed;
-            } else if (!(hotkey_override)) {
-              state.hotkey_jsdevice = event.cdevice.which;
-              state.hotkey_pressed = is_pressed;
-            }
-            if (state.hotkey_pressed && (state.hotkey_jsdevice == event.cdevice.which)) {
-              state.hotkey_was_pressed = true; // if hotkey is pressed, note the details of hotkey press in case it is released without triggering a hotkey combo event, since its press will need to be processed
-              
-            } else if (state.hotkey_combo_triggered && !(is_pressed)) { 
-              state.hotkey_combo_triggered = false; //hotkey combo was pressed; ignore hotkey button release
-              state.hotkey_was_pressed = false; //reset hotkey
-              
-            } else if (state.hotkey_was_pressed && !(is_pressed)) { 
-              state.hotkey_was_pressed = false;
-              emitKey(config.guide, true, config.guide_modifier); //key pressed and now released without hotkey trigger so process key press then key release
-              SDL_Delay(16);
-              emitKey(config.guide, is_pressed, config.guide_modifier);
-              if ((config.guide_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.guide))){
-                setKeyRepeat(config.guide, is_pressed);
-                //note: hotkey cannot be assigned for key repeat; release key repeat for completeness
-              }
-            } //hotkey state check prior to emitting key, to avoid conflicts with emitkey and hotkey press        
-              else {
-              emitKey(config.guide, is_pressed, config.guide_modifier);
-              if ((config.guide_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.guide))){
+            emitKey(config.guide, is_pressed, config.guide_modifier);
+            if ((config.guide_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.guide))){
                 setKeyRepeat(config.guide, is_pressed);
-              }
             }
             break;
 
           case SDL_CONTROLLER_BUTTON_BACK: // aka select
-          if (SDL_GameControllerGetBindForButton(controller, SDL_CONTROLLER_BUTTON_BACK).value.button == SDL_GameControllerGetBindForButton(controller, SDL_CONTROLLER_BUTTON_GUIDE).value.button) {
-            if ((kill_mode && !(hotkey_override)) || (kill_mode && hotkey_override && (strcmp(hotkey_code, "back") == 0))) {
-              state.hotkey_jsdevice = event.cdevice.which;
-              state.hotkey_pressed = is_pressed;
-            } else if (!(hotkey_override)) {
-              state.hotkey_jsdevice = event.cdevice.which;
-              state.hotkey_pressed = is_pressed;
-            }
-        }
-            if (state.hotkey_pressed && (state.hotkey_jsdevice == event.cdevice.which)) {
-              state.hotkey_was_pressed = true; // if hotkey is pressed, note the details of hotkey press in case it is released without triggering a hotkey combo event, since its press will need to be processed
-              
-            } else if (state.hotkey_combo_triggered && !(is_pressed)) { 
-              state.hotkey_combo_triggered = false; //hotkey combo was pressed; ignore hotkey button release
-              state.hotkey_was_pressed = false; //reset hotkey
-              
-            } else if (state.hotkey_was_pressed && !(is_pressed)) { 
-              state.hotkey_was_pressed = false;
-              emitKey(config.back, true, config.back_modifier); //key pressed and now released without hotkey trigger so process key press then key release
-              SDL_Delay(16);
-              emitKey(config.back, is_pressed, config.back_modifier);
-              if ((config.back_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.back))){
-                setKeyRepeat(config.back, is_pressed);
-                //note: hotkey cannot be assigned for key repeat; release key repeat for completeness
-              }
-            } //hotkey state check prior to emitting key, to avoid conflicts with emitkey and hotkey press        
-            else {
-              emitKey(config.back, is_pressed, config.back_modifier);
-              if ((config.back_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.back))){
+            emitKey(config.back, is_pressed, config.back_modifier);
+            if ((config.back_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.back))){
                 setKeyRepeat(config.back, is_pressed);
-              }
             }
             break;
 
@@ -1953,7 +5053,7 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
             } else if (state.start_was_pressed && !(is_pressed)) { //key pressed and now released without start trigger so process original key press, pause, then process key release
               state.start_was_pressed = false;
               emitKey(config.start, true, config.start_modifier);
-              SDL_Delay(16);
+              flushAndDelay(16);
               emitKey(config.start, is_pressed, config.start_modifier);
               //note: start cannot be assigned for key repeat; release key repeat for completeness
               if ((config.start_repeat && is_pressed && (state.key_to_repeat == 0)) || (!(is_pressed) && (state.key_to_repeat == config.start))){
@@ -1967,80 +5067,10 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
             }
             break;
         } //switch
-        if ((kill_mode) && (state.start_pressed && state.hotkey_pressed)) {
-          if (pckill_mode) {
-            emitKey(KEY_F4,true,KEY_LEFTALT);
-            SDL_Delay(15);
-            emitKey(KEY_F4,false,KEY_LEFTALT);
-          }
-          SDL_RemoveTimer( state.key_repeat_timer_id );
-          if (! sudo_kill) {
-             // printf("Killing: %s\n", AppToKill);
-             if (state.start_jsdevice == state.hotkey_jsdevice) {
-                char buffer[128];
-                sprintf(buffer, "killall -%d '%s' ", kill_signal, AppToKill);
-                std::cout << buffer << std::endl;
-                system(buffer);
-                sleep(3);
-                if (system((" pgrep '" + std::string(AppToKill) + "' ").c_str()) == 0) {
-                    printf("Forcefully Killing: %s\n", AppToKill);
-                    system((" killall  -9 '" + std::string(AppToKill) + "' ").c_str());
-                }
-                exit(0);
-             }
-          } else {
-             if (state.start_jsdevice == state.hotkey_jsdevice) {
-               system((" kill -9 $(pidof '" + std::string(AppToKill) + "') ").c_str());
-               sleep(3);
-               exit(0);
-             }
-           } // sudo kill
-        } //kill mode 
-        else if ((textinputpreset_mode) && (state.textinputpresettrigger_pressed && state.start_pressed)) { //activate input preset mode - send predefined text as a series of keystrokes
-            printf("text input preset pressed\n");
-            state.start_combo_triggered = true;
-            if (state.start_jsdevice == state.textinputpresettrigger_jsdevice) {
-                if (config.text_input_preset != NULL) {
-                    printf("text input processing %s\n", config.text_input_preset);
-                    processKeys();
-                }
-            }
-            state.textinputpresettrigger_pressed = false; //reset textinputpreset trigger
-            state.start_pressed = false;
-            state.start_jsdevice = 0;
-            state.textinputpresettrigger_jsdevice = 0;
-         } //input preset trigger mode (i.e. not kill mode)
-        else if ((textinputpreset_mode) && (state.textinputconfirmtrigger_pressed && state.start_pressed)) { //activate input preset confirm mode - send ENTER key
-            printf("text input confirm pressed\n");
-            state.start_combo_triggered = true;
-            if (state.start_jsdevice == state.textinputconfirmtrigger_jsdevice) {
-                printf("text input Enter key\n");
-                emitKey(char_to_keycode("enter"), true);
-                SDL_Delay(15);
-                emitKey(char_to_keycode("enter"), false);
-            }
-            state.textinputconfirmtrigger_pressed = false; //reset textinputpreset confirm trigger
-            state.start_pressed = false;
-            state.start_jsdevice = 0;
-            state.textinputconfirmtrigger_jsdevice = 0;
-          } //input confirm trigger mode (i.e. not kill mode)         
-        else if ((textinputinteractive_mode) && (state.textinputinteractivetrigger_pressed && state.start_pressed)) { //activate interactive text input mode
-            printf("text input interactive pressed\n");
-            state.start_combo_triggered = true;
-            if (state.start_jsdevice == state.textinputinteractivetrigger_jsdevice) {
-                printf("text input interactive mode active\n");
-                state.textinputinteractive_mode_active = true;
-                SDL_RemoveTimer( state.key_repeat_timer_id ); // disable any active key repeat timer
-                current_character = 0;
-
-                addTextInputCharacter();
-            }
-            state.textinputinteractivetrigger_pressed = false; //reset interactive text input mode trigger
-            state.start_pressed = false;
-            state.textinputinteractivetrigger_jsdevice = 0;
-            state.start_jsdevice = 0;
-          } //input interactive trigger mode (i.e. not kill mode)
       }  //xbox or config/default
+      if (mapping) {
+        handleStartCombos();
+      }
     } break; // case SDL_CONTROLLERBUTTONUP: SDL_CONTROLLERBUTTONDOWN:
 
     case SDL_CONTROLLERAXISMOTION:
@@ -2080,178 +5110,100 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
         
         switch (event.caxis.axis) {
           case SDL_CONTROLLER_AXIS_LEFTX:
-            state.current_left_analog_x =
-              applyDeadzone(event.caxis.value, config.deadzone_x);
+            state.current_left_analog_x = applyHysteresis(
+              event.caxis.axis, event.caxis.value, state.current_left_analog_x, config.deadzone_left, config.deadzone_right);
               left_axis_movement = true;
             break;
 
           case SDL_CONTROLLER_AXIS_LEFTY:
-            state.current_left_analog_y =
-              applyDeadzone(event.caxis.value, config.deadzone_y);
+            state.current_left_analog_y = applyHysteresis(
+              event.caxis.axis, event.caxis.value, state.current_left_analog_y, config.deadzone_up, config.deadzone_down);
               left_axis_movement = true;
             break;
 
           case SDL_CONTROLLER_AXIS_RIGHTX:
-            state.current_right_analog_x =
-              applyDeadzone(event.caxis.value, config.deadzone_x);
+            state.current_right_analog_x = applyHysteresis(
+              event.caxis.axis, event.caxis.value, state.current_right_analog_x, config.deadzone_left, config.deadzone_right);
               right_axis_movement = true;
             break;
 
           case SDL_CONTROLLER_AXIS_RIGHTY:
-            state.current_right_analog_y =
-              applyDeadzone(event.caxis.value, config.deadzone_y);
+            state.current_right_analog_y = applyHysteresis(
+              event.caxis.axis, event.caxis.value, state.current_right_analog_y, config.deadzone_up, config.deadzone_down);
               right_axis_movement = true;
             break;
 
           case SDL_CONTROLLER_AXIS_TRIGGERLEFT:
-            state.current_l2 = event.caxis.value;
+            state.current_l2 = applyHysteresis(
+              event.caxis.axis, event.caxis.value, state.current_l2, config.deadzone_l2, config.deadzone_l2);
             break;
 
           case SDL_CONTROLLER_AXIS_TRIGGERRIGHT:
-            state.current_r2 = event.caxis.value;
+            state.current_r2 = applyHysteresis(
+              event.caxis.axis, event.caxis.value, state.current_r2, config.deadzone_r2, config.deadzone_r2);
             break;
         } // switch (event.caxis.axis)
 
+        if (state.textinputinteractive_mode_active && textinputinteractive_daisywheel) {
+          if (left_axis_movement) {
+            selectDaisywheelGroup(
+              state.current_left_analog_x,
+              state.current_left_analog_y,
+              state.previous_axis_value[SDL_CONTROLLER_AXIS_LEFTX],
+              state.previous_axis_value[SDL_CONTROLLER_AXIS_LEFTY]);
+          }
         // fake mouse
-        if (config.left_analog_as_mouse && left_axis_movement) {
-          state.mouseX = state.current_left_analog_x / config.fake_mouse_scale;
-          state.mouseY = state.current_left_analog_y / config.fake_mouse_scale;
+        } else if (config.left_analog_as_mouse && left_axis_movement) {
+          if (config.mouse_absolute == MOUSE_ABSOLUTE_POSITION) {
+            emitPointerPosition(state.current_left_analog_x, state.current_left_analog_y);
+          } else {
+            state.mouseX = state.current_left_analog_x / config.fake_mouse_scale;
+            state.mouseY = state.current_left_analog_y / config.fake_mouse_scale;
+          }
         } else if (config.right_analog_as_mouse && right_axis_movement) {
-          state.mouseX = state.current_right_analog_x / config.fake_mouse_scale;
-          state.mouseY = state.current_right_analog_y / config.fake_mouse_scale;
+          if (config.mouse_absolute == MOUSE_ABSOLUTE_POSITION) {
+            emitPointerPosition(state.current_right_analog_x, state.current_right_analog_y);
+          } else {
+            state.mouseX = state.current_right_analog_x / config.fake_mouse_scale;
+            state.mouseY = state.current_right_analog_y / config.fake_mouse_scale;
+          }
+        } else if (config.left_analog_as_wheel && left_axis_movement) {
+          state.wheel_x_speed = (float)state.current_left_analog_x / config.mouse_wheel_scale;
+          state.wheel_y_speed = -(float)state.current_left_analog_y / config.mouse_wheel_scale;
+        } else if (config.right_analog_as_wheel && right_axis_movement) {
+          state.wheel_x_speed = (float)state.current_right_analog_x / config.mouse_wheel_scale;
+          state.wheel_y_speed = -(float)state.current_right_analog_y / config.mouse_wheel_scale;
         } else {
           // Analogs trigger keys
           if (!(state.textinputinteractive_mode_active)) {
-            handleAnalogTrigger(
-              state.current_left_analog_y < 0,
-              state.left_analog_was_up,
-              config.left_analog_up,
-              config.left_analog_up_modifier);
-            if ((state.current_left_analog_y < 0 ) && config.left_analog_up_repeat && (state.key_to_repeat == 0)) {
-                setKeyRepeat(config.left_analog_up, true);
-            } else if ((state.current_left_analog_y == 0 ) && config.left_analog_up_repeat && (state.key_to_repeat == config.left_analog_up)) {
-                setKeyRepeat(config.left_analog_up, false);
-            }
-
-            handleAnalogTrigger(
-              state.current_left_analog_y > 0,
-              state.left_analog_was_down,
-              config.left_analog_down,
-              config.left_analog_down_modifier);
-            if ((state.current_left_analog_y > 0 ) && config.left_analog_down_repeat && (state.key_to_repeat == 0)) {
-                setKeyRepeat(config.left_analog_down, true);
-            } else if ((state.current_left_analog_y == 0 ) && config.left_analog_down_repeat && (state.key_to_repeat == config.left_analog_down)) {
-                setKeyRepeat(config.left_analog_down, false);
-            }
-
-            handleAnalogTrigger(
-              state.current_left_analog_x < 0,
-              state.left_analog_was_left,
-              config.left_analog_left,
-              config.left_analog_left_modifier);
-            if ((state.current_left_analog_x < 0 ) && config.left_analog_left_repeat && (state.key_to_repeat == 0)) {
-                setKeyRepeat(config.left_analog_left, true);
-            } else if ((state.current_left_analog_x == 0 ) && config.left_analog_left_repeat && (state.key_to_repeat == config.left_analog_left)) {
-                setKeyRepeat(config.left_analog_left, false);
-            }
-
-            handleAnalogTrigger(
-              state.current_left_analog_x > 0,
-              state.left_analog_was_right,
-              config.left_analog_right,
-              config.left_analog_right_modifier);
-            if ((state.current_left_analog_x > 0 ) && config.left_analog_right_repeat && (state.key_to_repeat == 0)) {
-                setKeyRepeat(config.left_analog_right, true);
-            } else if ((state.current_left_analog_x == 0 ) && config.left_analog_right_repeat && (state.key_to_repeat == config.left_analog_right)) {
-                setKeyRepeat(config.left_analog_right, false);
-            }
-
-            handleAnalogTrigger(
-              state.current_right_analog_y < 0,
-              state.right_analog_was_up,
-              config.right_analog_up,
-              config.right_analog_up_modifier);
-            if ((state.current_right_analog_y < 0 ) && config.right_analog_up_repeat && (state.key_to_repeat == 0)) {
-                setKeyRepeat(config.right_analog_up, true);
-            } else if ((state.current_right_analog_y == 0 ) && config.right_analog_up_repeat && (state.key_to_repeat == config.right_analog_up)) {
-                setKeyRepeat(config.right_analog_up, false);
-            }
-
-            handleAnalogTrigger(
-              state.current_right_analog_y > 0,
-              state.right_analog_was_down,
-              config.right_analog_down,
-              config.right_analog_down_modifier);
-            if ((state.current_right_analog_y > 0 ) && config.right_analog_down_repeat && (state.key_to_repeat == 0)) {
-                setKeyRepeat(config.right_analog_down, true);
-            } else if ((state.current_right_analog_y == 0 ) && config.right_analog_down_repeat && (state.key_to_repeat == config.right_analog_down)) {
-                setKeyRepeat(config.right_analog_down, false);
-            }
-
-            handleAnalogTrigger(
-              state.current_right_analog_x < 0,
-              state.right_analog_was_left,
-              config.right_analog_left,
-              config.right_analog_left_modifier);
-            if ((state.current_right_analog_x < 0 ) && config.right_analog_left_repeat && (state.key_to_repeat == 0)) {
-                setKeyRepeat(config.right_analog_left, true);
-            } else if ((state.current_right_analog_x == 0 ) && config.right_analog_left_repeat && (state.key_to_repeat == config.right_analog_left)) {
-                setKeyRepeat(config.right_analog_left, false);
-            }
-
-            handleAnalogTrigger(
-              state.current_right_analog_x > 0,
-              state.right_analog_was_right,
-              config.right_analog_right,
-              config.right_analog_right_modifier);
-            if ((state.current_right_analog_x > 0 ) && config.right_analog_right_repeat && (state.key_to_repeat == 0)) {
-                setKeyRepeat(config.right_analog_right, true);
-            } else if ((state.current_right_analog_x == 0 ) && config.right_analog_right_repeat && (state.key_to_repeat == config.right_analog_right)) {
-                setKeyRepeat(config.right_analog_right, false);
-            }
+            handleAnalogStick(
+              analogDirections(
+                state.current_left_analog_x,
+                state.current_left_analog_y,
+                state.previous_axis_value[SDL_CONTROLLER_AXIS_LEFTX],
+                state.previous_axis_value[SDL_CONTROLLER_AXIS_LEFTY],
+                config.left_analog_mode),
+              true);
+            handleAnalogStick(
+              analogDirections(
+                state.current_right_analog_x,
+                state.current_right_analog_y,
+                state.previous_axis_value[SDL_CONTROLLER_AXIS_RIGHTX],
+                state.previous_axis_value[SDL_CONTROLLER_AXIS_RIGHTY],
+                config.right_analog_mode),
+              false);
           } //!(state.textinputinteractive_mode_active)
         } // Analogs trigger keys 
 
-        if (state.hotkey_pressed) {
-          handleAnalogTrigger(
-            state.current_l2 > config.deadzone_triggers,
-            state.l2_hk_was_pressed,
-            config.l2_hk,
-            config.l2_hk_modifier);
-          handleAnalogTrigger(
-            state.current_r2 > config.deadzone_triggers,
-            state.r2_hk_was_pressed,
-            config.r2_hk,
-            config.r2_hk_modifier);
-          if (state.l2_hk_was_pressed || state.r2_hk_was_pressed) state.hotkey_combo_triggered = true;
-        } else if (state.l2_hk_was_pressed || state.r2_hk_was_pressed) {
-          handleAnalogTrigger(
-            state.current_l2 > config.deadzone_triggers,
-            state.l2_hk_was_pressed,
-            config.l2_hk,
-            config.l2_hk_modifier);
-          handleAnalogTrigger(
-            state.current_r2 > config.deadzone_triggers,
-            state.r2_hk_was_pressed,
-            config.r2_hk,
-            config.r2_hk_modifier);
-        } else {
-          handleAnalogTrigger(
-            state.current_l2 > config.deadzone_triggers,
-            state.l2_was_pressed,
-            config.l2,
-            config.l2_modifier);
-          handleAnalogTrigger(
-            state.current_r2 > config.deadzone_triggers,
-            state.r2_was_pressed,
-            config.r2,
-            config.r2_modifier);
-        }
+        handleTriggerKey(LAYER_L2, state.current_l2 > 0, state.l2_was_pressed, config.l2, config.l2_modifier);
+        handleTriggerKey(LAYER_R2, state.current_r2 > 0, state.r2_was_pressed, config.r2, config.r2_modifier);
       } // end of else for indicating which axis was moved before checking whether it's assigned as mouse
       break;
     case SDL_CONTROLLERDEVICEADDED:
       if (xbox360_mode == true || config_mode == true) {
-        SDL_GameControllerOpen(0);
+        force_feedback.controller = SDL_GameControllerOpen(0);
+        enableGyro(force_feedback.controller);
+        watchController(force_feedback.controller);
         /* SDL_GameController* controller = SDL_GameControllerOpen(0);
      if (controller) {
                       const char *name = SDL_GameControllerNameForIndex(0);
@@ -2259,7 +5211,7 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
                   }
   */
       } else {
-        SDL_GameControllerOpen(event.cdevice.which);
+        watchController(SDL_GameControllerOpen(event.cdevice.which));
       }
       break;
 
@@ -2267,22 +5219,99 @@ SDL_GameController* controller = SDL_GameControllerFromInstanceID(event.cdevice.
       if (
         SDL_GameController* controller =
           SDL_GameControllerFromInstanceID(event.cdevice.which)) {
+        if (controller == force_feedback.controller) {
+          force_feedback.controller = NULL;
+        }
         SDL_GameControllerClose(controller);
       }
+      if (event.cdevice.which == gyro.controller) {
+        gyro.controller = -1;
+      }
+      unwatchController(event.cdevice.which);
+      gyro.button_held = false;
+      releaseAllKeys(); // the button releases will never arrive
+      break;
+
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+    case SDL_CONTROLLERTOUCHPADDOWN:
+    case SDL_CONTROLLERTOUCHPADMOTION:
+    case SDL_CONTROLLERTOUCHPADUP:
+      if (!xbox360_mode && !state.textinputinteractive_mode_active) {
+        handleTouchpad(event.type, event.ctouchpad);
+      }
       break;
+#endif
+
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+    case SDL_CONTROLLERSENSORUPDATE:
+      if (event.csensor.sensor == SDL_SENSOR_GYRO) {
+        handleGyro(event.csensor);
+      }
+      break;
+#endif
 
     case SDL_QUIT:
       return false;
       break;
+
+    default:
+      if (force_feedback.event_type != 0 && event.type == force_feedback.event_type) {
+        playRumble(event.user);
+      } else if (stats.event_type != 0 && event.type == stats.event_type) {
+        takeStatsSnapshot();
+      }
+      break;
   }
 
   return true;
 }
 
+void prefaultStack()
+{
+  volatile char stack[256 * 1024];
+  for (size_t i = 0; i < sizeof(stack); i += 4096) {
+    stack[i] = 0;
+  }
+}
+
+void applyRealtimeOptions()
+{
+  if (realtime.cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(realtime.cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+      printf("Unable to pin the input thread to CPU %d: %s\n", realtime.cpu, strerror(errno));
+    }
+  }
+  if (realtime.rt_priority > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = realtime.rt_priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+      printf("Unable to set real-time priority %d: %s\n", realtime.rt_priority, strerror(errno));
+    }
+  }
+  if (realtime.mlock) {
+    // every buffer on the event path is static or mapped before this point and
+    // gets locked in by MCL_CURRENT; the stack has to be grown first
+    prefaultStack();
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+      printf("Unable to lock memory: %s\n", strerror(errno));
+    }
+  }
+}
+
 int main(int argc, char* argv[])
 {
   const char* config_file = nullptr;
 
+  // SIGUSR1 asks for a stats dump; block it before any thread starts so only the stats thread receives it
+  sigset_t stats_signal;
+  sigemptyset(&stats_signal);
+  sigaddset(&stats_signal, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &stats_signal, NULL);
+
   config_mode = true;
   config_file = "/emuelec/configs/gptokeyb/default.gptk";
 
@@ -2298,6 +5327,11 @@ int main(int argc, char* argv[])
     config.text_input_preset = env_textinput;
   }
 
+  // Add keyboard layout environment variable if available, for text input
+  if (char* env_layout = SDL_getenv("GPTOKEYB_KEYBOARD_LAYOUT")) {
+    config.keyboard_layout = keyboardLayoutFromName(env_layout);
+  }
+
   // Add textinput_interactive environment variable if available
   if (char* env_textinput_interactive = SDL_getenv("TEXTINPUTINTERACTIVE")) {
     if (strcmp(env_textinput_interactive,"Y") == 0) {
@@ -2306,6 +5340,26 @@ int main(int argc, char* argv[])
     }
   }
 
+  // Add controller state export environment variable if available
+  if (char* env_state = SDL_getenv("GPTOKEYB_STATE")) {
+    shared_state.path = env_state;
+  }
+
+  // Add stats file environment variable if available
+  if (char* env_stats = SDL_getenv("GPTOKEYB_STATS")) {
+    stats.path = env_stats;
+  }
+
+  // Add log verbosity environment variable if available
+  if (char* env_log_level = SDL_getenv("GPTOKEYB_LOG_LEVEL")) {
+    logger.level = logLevelFromString(env_log_level);
+  }
+
+  // Add flight recorder environment variable if available
+  if (char* env_recorder = SDL_getenv("GPTOKEYB_RECORDER")) {
+    recorder.path = env_recorder;
+  }
+
   // Add pc alt+f4 exit environment variable if available
   if (char* env_pckill_mode = SDL_getenv("PCKILLMODE")) {
     if (strcmp(env_pckill_mode,"Y") == 0) {
@@ -2352,6 +5406,38 @@ int main(int argc, char* argv[])
           app_exult_adjust = true;
         }
       } 
+    } else if (strcmp(argv[ii], "--rt-priority") == 0) {
+      if (ii + 1 < argc) {
+        realtime.rt_priority = atoi(argv[++ii]);
+      }
+    } else if (strcmp(argv[ii], "--cpu") == 0) {
+      if (ii + 1 < argc) {
+        realtime.cpu = atoi(argv[++ii]);
+      }
+    } else if (strcmp(argv[ii], "--mlock") == 0) {
+      realtime.mlock = true;
+    } else if (strcmp(argv[ii], "--type-file") == 0) {
+      if (ii + 1 < argc) {
+        text_stream.path = argv[++ii];
+      }
+    } else if (strcmp(argv[ii], "-stats") == 0) {
+      if (ii + 1 < argc) {
+        stats.path = argv[++ii];
+      }
+    } else if (strcmp(argv[ii], "-loglevel") == 0) {
+      if (ii + 1 < argc) {
+        logger.level = logLevelFromString(argv[++ii]);
+      }
+    } else if (strcmp(argv[ii], "-recorder") == 0) {
+      if (ii + 1 < argc) {
+        recorder.path = argv[++ii];
+      }
+    } else if (strcmp(argv[ii], "--dump-recorder") == 0) {
+      return dumpRecorder(ii + 1 < argc ? argv[ii + 1] : "/run/gptokeyb.recorder");
+    } else if (strcmp(argv[ii], "-state") == 0) {
+      if (ii + 1 < argc) {
+        shared_state.path = argv[++ii];
+      }
     } else if (strcmp(argv[ii], "-killsignal") == 0) {
         if (ii + 1 < argc) { 
           kill_mode = true;
@@ -2372,14 +5458,26 @@ int main(int argc, char* argv[])
       if (strcmp(env_textinput_extrasymbols,"Y") == 0) {
         textinputinteractive_extrasymbols = true;
       }
+    }
+    if (char* env_textinput_dictionary = SDL_getenv("TEXTINPUTDICTIONARY")) { // word list for suggestions
+      dictionary.path = env_textinput_dictionary;
+    }
+    if (char* env_textinput_daisywheel = SDL_getenv("TEXTINPUTDAISYWHEEL")) { // pick characters with the left stick and face buttons
+      if (strcmp(env_textinput_daisywheel,"Y") == 0) {
+        textinputinteractive_daisywheel = true;
+      }
     }    
   }
 
 
+  if (recorder.path != NULL) {
+    openRecorder();
+  }
+
   // Create fake input device (not needed in kill mode)
   //if (!kill_mode) {  
   if (config_mode || xbox360_mode || textinputinteractive_mode) { // initialise device, even in kill mode, now that kill mode will work with config & xbox modes
-    uinp_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    uinp_fd = open("/dev/uinput", O_RDWR | O_NONBLOCK); // read for rumble requests
     if (uinp_fd < 0) {
       printf("Unable to open /dev/uinput\n");
       return -1;
@@ -2397,11 +5495,15 @@ int main(int argc, char* argv[])
       printf("Running in Fake Keyboard mode\n");
       setupFakeKeyboardMouseDevice(uidev, uinp_fd);
 
+      setHotkeyLayer(); // the _hk defaults, before the config file overrides them
       // if we are in config mode, read the file
       if (config_mode) {
         printf("Using ConfigFile %s\n", config_file);
         readConfigFile(config_file);
       }
+      setDefaultDeadzones();
+      setAnalogSectors();
+      buildLayerTable();
       // if we are in textinput mode, note the text preset
       if (textinputpreset_mode) {
         if (config.text_input_preset != NULL) {
@@ -2411,6 +5513,11 @@ int main(int argc, char* argv[])
             //textinputpreset_mode = false;   removed so that Enter key can be pressed
         }
       } 
+    }
+    // text is typed as it would be on the selected keyboard layout
+    buildTextLayout();
+    if (textinputpreset_mode && config.text_input_preset != NULL) {
+      compileTextPreset(config.text_input_preset);
     }
             // if we are in textinputinteractive mode, initialise the character set
     if (textinputinteractive_mode) {
@@ -2418,6 +5525,7 @@ int main(int argc, char* argv[])
         printf("interactive text input mode available\n");
         if (textinputinteractive_noautocapitals) printf("interactive text input mode without auto-capitals\n");
         if (textinputinteractive_extrasymbols) printf("interactive text input mode includes extra symbols\n");
+        if (textinputinteractive_daisywheel) printf("interactive text input mode uses the daisywheel\n");
     
     }
     // Create input device into input sub-system
@@ -2427,6 +5535,25 @@ int main(int argc, char* argv[])
       printf("Unable to create UINPUT device.");
       return -1;
     }
+
+    if (!xbox360_mode && config.mouse_absolute != MOUSE_RELATIVE) {
+      pointer.fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+      if (pointer.fd < 0) {
+        printf("Unable to open /dev/uinput\n");
+        return -1;
+      }
+      memset(&pointer.device, 0, sizeof(pointer.device));
+      pointer.device.id.version = 1;
+      pointer.device.id.bustype = BUS_USB;
+      printf("Using absolute mouse on a %dx%d fake touchscreen\n", config.mouse_absolute_width, config.mouse_absolute_height);
+      setupFakeTouchscreenDevice(pointer.device, pointer.fd);
+      write(pointer.fd, &pointer.device, sizeof(pointer.device));
+      if (ioctl(pointer.fd, UI_DEV_CREATE)) {
+        printf("Unable to create UINPUT device.");
+        return -1;
+      }
+      movePointer(config.mouse_absolute_width / 2, config.mouse_absolute_height / 2);
+    }
   }
 
   if (const char* db_file = SDL_getenv("SDL_GAMECONTROLLERCONFIG_FILE")) {
@@ -2434,33 +5561,114 @@ int main(int argc, char* argv[])
   }
 
   // SDL initialization and main loop
-  if (SDL_Init(SDL_INIT_GAMECONTROLLER | SDL_INIT_TIMER) != 0) {
+  if (SDL_Init(SDL_INIT_GAMECONTROLLER) != 0) {
     printf("SDL_Init() failed: %s\n", SDL_GetError());
     return -1;
   }
+  startPowerSave();
+
+  if (xbox360_mode) {
+    force_feedback.event_type = SDL_RegisterEvents(1);
+    if (force_feedback.event_type == (Uint32)-1) {
+      force_feedback.event_type = 0;
+    } else if (SDL_Thread* thread = SDL_CreateThread(forceFeedbackThread, "rumble", NULL)) {
+      SDL_DetachThread(thread);
+    } else {
+      printf("rumble not available: %s\n", SDL_GetError());
+      force_feedback.event_type = 0;
+    }
+  }
+
+  if (shared_state.path != NULL) {
+    openSharedState();
+  }
+
+  // from here on messages are written out by the logger thread
+  startLogger();
+  startStats();
+  startDictionary();
+  atexit(stopLogger); // the kill combo exits from inside handleEvent
+
+  // after the helper threads are created, so only the input thread is affected
+  applyRealtimeOptions();
+  openTextStream();
+  counting_allocations = true;
 
   SDL_Event event;
   bool running = true;
+  Uint64 next_mouse_tick = 0;
   while (running) {
-    if (state.mouseX != 0 || state.mouseY != 0) {
+    // sleep until the next controller event, or until the mouse tick or another timer is due
+    Uint64 now = monotonicTimeUs();
+    Uint64 deadline = earliestDeadline(nextMacroDeadline(), nextDualRoleDeadline());
+    deadline = earliestDeadline(deadline, nextKeyRepeatDeadline());
+    deadline = earliestDeadline(deadline, nextTurboDeadline());
+    deadline = earliestDeadline(deadline, nextTouchpadDeadline());
+    deadline = earliestDeadline(deadline, nextRumbleDeadline(now));
+    deadline = earliestDeadline(deadline, nextTextStreamDeadline());
+    if (mouseMoving()) {
+      if (next_mouse_tick == 0) {
+        next_mouse_tick = now;
+      }
+      deadline = earliestDeadline(deadline, next_mouse_tick);
+    } else {
+      next_mouse_tick = 0;
+    }
+
+    const int got_event = waitForEvent(&event, deadline);
+    if (got_event < 0) {
+      logMessage(LOG_ERROR, "waiting for events failed: %s\n", SDL_GetError());
+      return -1;
+    }
+    stats.counters.wakeups++;
+
+    if (got_event) {
+      running = handleEvent(event);
+      // drain the rest of the batch so motion from the same controller frame is reported together
       while (running && SDL_PollEvent(&event)) {
         running = handleEvent(event);
       }
+    }
 
-      emitMouseMotion(state.mouseX, state.mouseY);
-      SDL_Delay(config.fake_mouse_delay);
-    } else {
-      if (!SDL_WaitEvent(&event)) {
-        printf("SDL_WaitEvent() failed: %s\n", SDL_GetError());
-        return -1;
+    now = monotonicTimeUs();
+    if (!got_event && deadline != 0 && deadline <= now) {
+      // woken for a timer: how late did we get to run
+      const Uint64 latency = now - deadline;
+      realtime.latency_samples++;
+      realtime.latency_total_us += latency;
+      if (latency > realtime.latency_max_us) realtime.latency_max_us = latency;
+    }
+    if (next_mouse_tick != 0 && next_mouse_tick <= now && mouseMoving()) {
+      const int stretch = mouseTickStretch();
+      emitMouseTick(stretch);
+      next_mouse_tick += config.fake_mouse_delay * 1000 * stretch;
+      if (next_mouse_tick <= now) {
+        next_mouse_tick = now + config.fake_mouse_delay * 1000 * stretch; // fell behind, don't burst to catch up
       }
-
-      running = handleEvent(event);
     }
+    runKeyRepeat(now);
+    runTurbo(now);
+    runMacros(now);
+    runDualRoles(now);
+    runTouchpad(now);
+    runTextStream(now);
+    flushEvents();
+    publishSharedState();
   }
-  SDL_RemoveTimer( state.key_repeat_timer_id );
+  counting_allocations = false;
+  // SIGINT/SIGTERM become SDL_QUIT (SDL's handlers, or quit_fd with power_save), so this also runs when we are killed
+  releaseAllKeys();
+  record(RECORD_NOTE, 0, RECORDER_NOTE_EXIT, 0);
+  stopLogger();
   SDL_Quit();
 
+  printf("analog transitions suppressed by hysteresis: %lu\n", state.analog_transitions_suppressed);
+  printf("worst turbo timing error: %llu us\n", (unsigned long long)turbo.max_lateness_us);
+  printf("timer wakeup latency: %llu us average, %llu us worst over %lu wakeups\n",
+    (unsigned long long)(realtime.latency_samples ? realtime.latency_total_us / realtime.latency_samples : 0),
+    (unsigned long long)realtime.latency_max_us, realtime.latency_samples);
+  printf("operator new calls in the main loop: %lu\n", realtime.allocations);
+
   /*
     * Give userspace some time to read the events before we destroy the
     * device with UI_DEV_DESTROY.
@@ -2470,5 +5678,12 @@ int main(int argc, char* argv[])
   /* Clean up */
   ioctl(uinp_fd, UI_DEV_DESTROY);
   close(uinp_fd);
+  if (shared_state.mapped != NULL) {
+    unlink(shared_state.path);
+  }
+  if (pointer.fd >= 0) {
+    ioctl(pointer.fd, UI_DEV_DESTROY);
+    close(pointer.fd);
+  }
   return 0;
 }